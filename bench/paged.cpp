@@ -0,0 +1,60 @@
+// Benchmark for paged storage: random insertions and lookups of ints in
+// the heap, and in paged storage with all pages in memory and with only a
+// quarter of them.  Evicted pages stay in the kernel's page cache, so the
+// last case measures the cost of faulting pages in again, not of reading
+// them from the disk; that needs a data set larger than memory.
+//
+//   g++ -O2 -std=c++14 -pthread -Isrc bench/paged.cpp -o paged
+//   ./paged [n [file]]
+//
+// n defaults to 2*10^6 keys and file to /var/tmp/paged.pages.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "avltree.hpp"
+#include "paged.hpp"
+
+using namespace std;
+typedef chrono::steady_clock timer;
+
+static double nanos(timer::duration d) {
+  return chrono::duration<double, nano>(d).count();
+}
+
+// Inserts n random keys in a tree, looks them up, and prints the average
+// time of each.
+template <typename Tree>
+static void run(const char *name, int n) {
+  Tree t;
+  mt19937 rng(3);
+  timer::time_point a = timer::now();
+  for (int i = 0; i < n; ++i) t.insert(rng());
+  timer::time_point b = timer::now();
+  rng.seed(3);
+  int found = 0;
+  for (int i = 0; i < n; ++i) found += t.lookup(rng()) != t.end();
+  timer::time_point c = timer::now();
+  printf("%-22s %10.0f %10.0f %s\n", name, nanos(b - a) / n, nanos(c - b) / n,
+         found == n ? "" : "MISSING");
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 2000000;
+  string file = argc > 2 ? argv[2] : "/var/tmp/paged.pages";
+  typedef avltree<int, paged_storage<>> paged_tree;
+
+  printf("%-22s %10s %10s\n", "storage", "insert ns", "lookup ns");
+  run<avltree<int>>("heap", n);
+  paged_storage<>::open(file, size_t(1) << 20);
+  run<paged_tree>("paged, all resident", n);
+  size_t pages = paged_storage<>::pages();
+  paged_storage<>::close();
+  paged_storage<>::open(file, pages / 4);
+  run<paged_tree>("paged, 1/4 resident", n);
+  paged_storage<>::close();
+  printf("%zu pages\n", pages);
+}
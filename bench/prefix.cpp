@@ -0,0 +1,88 @@
+// Benchmark for cached key prefixes: insertion and lookup of string keys,
+// with the prefix cached in the nodes (std::string) and without it (a
+// wrapper with no key_traits), for three kinds of keys:
+//   urls    URLs, all of which share their first 7 characters ("http://"
+//           or "https:/"), so that the prefix never decides a comparison
+//   ids7    random 7-letter identifiers, compared by the prefix alone
+//   ids16   random 16-letter identifiers, mostly decided by the prefix
+//
+//   g++ -O2 -std=c++14 -pthread -Isrc bench/prefix.cpp -o prefix
+//   ./prefix [n]
+//
+// n defaults to 10^6 keys of each kind.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "avltree.hpp"
+
+using namespace std;
+typedef chrono::steady_clock timer;
+
+// A string key without a cached prefix.
+struct plain_string {
+  string s;
+  friend bool operator<(const plain_string &a, const plain_string &b) {
+    return a.s < b.s;
+  }
+  friend bool operator>(const plain_string &a, const plain_string &b) {
+    return b.s < a.s;
+  }
+};
+
+static double millis(timer::duration d) {
+  return chrono::duration<double, milli>(d).count();
+}
+
+// Inserts the keys in a tree of keys of type K, then looks them up in
+// shuffled order, and prints the times.
+template <typename K>
+static void run(const char *kind, const char *name, vector<K> keys) {
+  avltree<K> t;
+  timer::time_point a = timer::now();
+  for (const K &k : keys) t.insert(k);
+  timer::time_point b = timer::now();
+  shuffle(keys.begin(), keys.end(), mt19937(2));
+  int found = 0;
+  timer::time_point c = timer::now();
+  for (const K &k : keys) found += t.lookup(k) != t.end();
+  timer::time_point d = timer::now();
+  printf("%-6s %-9s %10.0f %10.0f %s\n", kind, name, millis(b - a),
+         millis(d - c), found == (int)keys.size() ? "" : "MISSING");
+}
+
+static void run(const char *kind, const vector<string> &keys) {
+  vector<plain_string> plain;
+  for (const string &k : keys) plain.push_back(plain_string{k});
+  run(kind, "plain", plain);
+  run(kind, "prefix", keys);
+}
+
+static string letters(mt19937 &rng, int n) {
+  string s(n, ' ');
+  for (char &c : s) c = 'a' + rng() % 26;
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  mt19937 rng(9);
+  const char *hosts[] = {"https://www.example.com/",
+                         "https://api.example.org/v1/",
+                         "http://cdn.example.net/static/"};
+  vector<string> urls, ids7, ids16;
+  for (int i = 0; i < n; ++i)
+    urls.push_back(string(hosts[rng() % 3]) + "item/" + to_string(rng()));
+  for (int i = 0; i < n; ++i) ids7.push_back(letters(rng, 7));
+  for (int i = 0; i < n; ++i) ids16.push_back(letters(rng, 16));
+
+  printf("%-6s %-9s %10s %10s\n", "keys", "nodes", "insert ms", "lookup ms");
+  run("urls", urls);
+  run("ids7", ids7);
+  run("ids16", ids16);
+}
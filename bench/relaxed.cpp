@@ -0,0 +1,69 @@
+// Benchmark for relaxed balance mode: the latency of each insertion, in
+// strict mode and in relaxed mode with several budgets, with keys in
+// random and in ascending order, and the time of the final settle().
+//
+//   g++ -O2 -std=c++14 -pthread -Isrc bench/relaxed.cpp -o relaxed
+//   ./relaxed [n]
+//
+// n defaults to 10^6 random keys; ascending runs use n / 10 keys, and
+// relax(0), whose height is unbounded, at most 20000 of them.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "avltree.hpp"
+
+using namespace std;
+typedef chrono::steady_clock timer;
+
+static long nanos(timer::duration d) {
+  return chrono::duration_cast<chrono::nanoseconds>(d).count();
+}
+
+// Inserts the keys in a tree in the given mode (budget < 0 for strict)
+// and prints the percentiles of the insertion latency.
+static void run(const char *order, const vector<int> &keys, int budget) {
+  avltree<int> t;
+  if (budget >= 0) t.relax(budget);
+  vector<long> lat(keys.size());
+  timer::time_point start = timer::now();
+  for (size_t i = 0; i < keys.size(); ++i) {
+    timer::time_point a = timer::now();
+    t.insert(keys[i]);
+    lat[i] = nanos(timer::now() - a);
+  }
+  long total = nanos(timer::now() - start);
+  timer::time_point a = timer::now();
+  t.settle();
+  long settle = nanos(timer::now() - a);
+  sort(lat.begin(), lat.end());
+  size_t n = lat.size();
+  char mode[16];
+  if (budget < 0)
+    snprintf(mode, sizeof mode, "strict");
+  else
+    snprintf(mode, sizeof mode, "relax(%d)", budget);
+  printf("%-10s %-9s %8zu %9.1f %7ld %7ld %8ld %9ld %9.1f %s\n", order, mode,
+         n, total / 1e6, lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000],
+         lat[n - 1], settle / 1e6, t.sanity() ? "" : "INSANE");
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  mt19937 rng(1);
+  vector<int> random(n), ascending(n / 10);
+  for (int &x : random) x = rng();
+  for (int i = 0; i < n / 10; ++i) ascending[i] = i;
+  vector<int> few(ascending.begin(),
+                  ascending.begin() + min<size_t>(ascending.size(), 20000));
+
+  printf("%-10s %-9s %8s %9s %7s %7s %8s %9s %9s\n", "keys", "mode", "n",
+         "total ms", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "settle ms");
+  for (int budget : {-1, 0, 1, 4}) run("random", random, budget);
+  for (int budget : {-1, 0, 1, 4})
+    run("ascending", budget == 0 ? few : ascending, budget);
+}
@@ -0,0 +1,95 @@
+// Benchmark for relayout(): random lookups in a tree aged by many removals
+// and insertions, before and after a full relayout() and after a pass of
+// incremental relayout(cursor, budget), with the time and the memory
+// (resident set size) that each one takes.
+//
+//   g++ -O2 -std=c++14 -pthread -Isrc bench/relayout.cpp -o relayout
+//   ./relayout [n [budget]]
+//
+// n defaults to 10^6 keys, aged by 4n remove/insert pairs, and budget to
+// 4096 nodes per incremental call.  Linux only, for the resident set size.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "avltree.hpp"
+
+using namespace std;
+typedef chrono::steady_clock timer;
+
+static double millis(timer::duration d) {
+  return chrono::duration<double, milli>(d).count();
+}
+
+// Returns the resident set size of the process, in MB.
+static long rss() {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == nullptr) return -1;
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof line, f) != nullptr)
+    if (strncmp(line, "VmRSS:", 6) == 0) kb = atol(line + 6);
+  fclose(f);
+  return kb / 1024;
+}
+
+// Returns the average time of a lookup of the given keys, in ns.
+static double lookups(avltree<int> &t, const vector<int> &keys) {
+  long found = 0;
+  timer::time_point a = timer::now();
+  for (int r = 0; r < 3; ++r)
+    for (int k : keys) found += t.lookup(k) != t.end();
+  double ns = millis(timer::now() - a) * 1e6 / (3 * keys.size());
+  return found >= 0 ? ns : 0;
+}
+
+// Builds an aged tree with n keys.
+static void age(avltree<int> &t, int n, mt19937 &rng) {
+  for (int i = 0; i < n; ++i) t.insert(rng() % (4 * n));
+  for (int i = 0; i < 4 * n; ++i) {
+    t.remove(rng() % (4 * n));
+    t.insert(rng() % (4 * n));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  int budget = argc > 2 ? atoi(argv[2]) : 4096;
+  mt19937 rng(4);
+  vector<int> keys;
+  for (int i = 0; i < n; ++i) keys.push_back(rng() % (4 * n));
+
+  {
+    avltree<int> t;
+    age(t, n, rng);
+    printf("full:         aged %.0f ns/lookup\n", lookups(t, keys));
+    long before = rss();
+    timer::time_point a = timer::now();
+    t.relayout();
+    double ms = millis(timer::now() - a);
+    printf("  relayout()  %.0f ns/lookup, %.0f ms, RSS %ld -> %ld MB, %s\n",
+           lookups(t, keys), ms, before, rss(),
+           t.sanity() ? "sane" : "INSANE");
+  }
+  {
+    avltree<int> t;
+    avltree<int>::relayout_cursor c;
+    age(t, n, rng);
+    printf("incremental:  aged %.0f ns/lookup\n", lookups(t, keys));
+    for (int pass = 1; pass <= 2; ++pass) {
+      long before = rss();
+      int calls = 1;
+      timer::time_point a = timer::now();
+      while (!t.relayout(c, budget)) ++calls;
+      double ms = millis(timer::now() - a);
+      printf("  pass %d      %.0f ns/lookup, %d calls of relayout(c, %d), "
+             "%.0f ms, RSS %ld -> %ld MB, %s\n",
+             pass, lookups(t, keys), calls, budget, ms, before, rss(),
+             t.sanity() ? "sane" : "INSANE");
+    }
+  }
+}
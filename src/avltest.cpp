@@ -1,12 +1,27 @@
+#include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <string>
+#include <vector>
 
 #include "avltree.hpp"
+#include "paged.hpp"
 
 using namespace std;
 
 // Simple driver program for testing the AVL tree implementation.
+// Run it as "avltest [kind]", where kind selects the tree:
+//
+//   (none)  avltree<int>
+//   paged n avltree<int> in paged storage, in file avltest.pages, with
+//           at most n pages in memory; with few of them, pages are
+//           evicted and faulted in again all the time
+//   small   avltree<int, heap_storage, 8>, which keeps up to 8 keys in an
+//           array, is promoted to nodes past 8 and demoted at 4
+//   index   avltree<int> with a hash index of its nodes, which sanity()
+//           checks too
+//   deferred avltree<int> with deferred reclamation (see d, g and G)
+//
 // It starts with an empty tree and reads from stdin commands of the form:
 //
 //   i key   insert key
@@ -16,10 +31,68 @@ using namespace std;
 //   c       clears the tree, i.e., removes all of its nodes
 //   p       prints the tree's elements using in-order traversal
 //   a       prints the result of the AVL sanity check
+//   x n     switches to relaxed balance mode, settling n nodes per update
+//   X       settles the tree and switches back to strict AVL mode
+//   +       prints the sum of all keys, computed in parallel
+//   b n ... applies a batch of n updates, each one being "i key" or
+//           "r key", and prints "Y" or "N" for each, depending on
+//           whether it changed the tree
+//   o n     relays out the tree, moving about n nodes to contiguous
+//           memory, or all of them if n is 0, and prints the result of
+//           the AVL sanity check
+//   m       prints the number of pages in the file and in memory, for
+//           paged storage
+//   d n     defers reclamation, destroying n pending nodes per update, or
+//           only in the background if n is 0; eager if n is negative
+//   g       prints the number of pending nodes
+//   G       destroys all pending nodes
 // All keys are integer numbers.
 
-int main() {
-	avltree<int> t;
+template <typename Tree>
+void pages(Tree &) {
+	cerr << "Not paged" << endl;
+}
+
+template <typename Tag>
+void pages(avltree<int, paged_storage<Tag>> &) {
+	cout << paged_storage<Tag>::pages() << " "
+	     << paged_storage<Tag>::resident() << endl;
+}
+
+template <typename Tree>
+void defer(Tree &, int) {
+	cerr << "No deferred reclamation" << endl;
+}
+
+template <typename Tree>
+void backlog(Tree &) {
+	cerr << "No deferred reclamation" << endl;
+}
+
+template <typename Tree>
+void reclaim(Tree &) {
+	cerr << "No deferred reclamation" << endl;
+}
+
+template <typename S, unsigned N, typename I>
+void defer(avltree<int, S, N, I, deferred_reclaim> &t, int n) {
+	if (n >= 0) t.defer_reclamation(n);
+	else t.eager_reclamation();
+}
+
+template <typename S, unsigned N, typename I>
+void backlog(avltree<int, S, N, I, deferred_reclaim> &t) {
+	cout << t.backlog() << endl;
+}
+
+template <typename S, unsigned N, typename I>
+void reclaim(avltree<int, S, N, I, deferred_reclaim> &t) {
+	t.reclaim();
+}
+
+template <typename Tree>
+void drive(Tree &t) {
+	typename Tree::relayout_cursor cursor;
 	char op;
 	while (cin >> op) {
 		switch (op) {
@@ -65,12 +138,94 @@ int main() {
 			else cout << "failed sanity check" << endl;
 			break;
 		}
+		case 'x': {
+			int budget;
+			cin >> budget;
+			t.relax(budget);
+			break;
+		}
+		case 'X': {
+			t.strict();
+			break;
+		}
+		case '+': {
+			cout << t.reduce(par, 0LL, [](long long x, long long y) {
+				return x + y;
+			}) << endl;
+			break;
+		}
+		case 'b': {
+			int n;
+			cin >> n;
+			vector<typename Tree::update> ops(n);
+			for (auto &u : ops) {
+				char c;
+				cin >> c >> u.key;
+				u.insert = c == 'i';
+			}
+			for (bool r : t.apply_batch(ops)) cout << (r ? "Y" : "N");
+			cout << endl;
+			break;
+		}
+		case 'm': {
+			pages(t);
+			break;
+		}
+		case 'd': {
+			int n;
+			cin >> n;
+			defer(t, n);
+			break;
+		}
+		case 'g': {
+			backlog(t);
+			break;
+		}
+		case 'G': {
+			reclaim(t);
+			break;
+		}
+		case 'o': {
+			int n;
+			cin >> n;
+			if (n > 0) t.relayout(cursor, n);
+			else t.relayout();
+			if (t.sanity()) cout << "passed sanity check" << endl;
+			else cout << "failed sanity check" << endl;
+			break;
+		}
 		default: {
 			cerr << "Unknown operation: " << op << endl;
 			cin.ignore(numeric_limits<streamsize>::max(), '\n');
 		}
 		}
 	}
-	
+}
 
+int main(int argc, char *argv[]) {
+	string kind = argc > 1 ? argv[1] : "";
+	if (kind == "paged") {
+		int n = argc > 2 ? atoi(argv[2]) : 16;
+		paged_storage<>::open("avltest.pages", n);
+		{
+			avltree<int, paged_storage<>> t;
+			drive(t);
+		}
+		paged_storage<>::close();
+	} else if (kind == "small") {
+		avltree<int, heap_storage, 8> t;
+		drive(t);
+	} else if (kind == "index") {
+		avltree<int, heap_storage, 0, hash_index<>> t;
+		drive(t);
+	} else if (kind == "deferred") {
+		avltree<int, heap_storage, 0, no_index, deferred_reclaim> t;
+		drive(t);
+	} else if (kind == "") {
+		avltree<int> t;
+		drive(t);
+	} else {
+		cerr << "Unknown kind of tree: " << kind << endl;
+		return 2;
+	}
 }
@@ -1,3 +1,20 @@
+#ifndef AVLTREE_HPP
+#define AVLTREE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "container.hpp"
 
 /* Reference implementation of AVL trees in C++, used in the course
@@ -16,21 +33,386 @@
  * sanity() function written by Ioannis Protogeros (see line 47)
  */
 
+// Key traits.  A specialization with has_prefix = true lets each node cache
+// a fixed-width, order-preserving prefix of its key, such that for any keys
+// x and y, prefix(x) < prefix(y) implies x < y, and prefix(x) == prefix(y)
+// together with exact(prefix(x)) implies x == y.  Searches compare the
+// cached prefixes first and only look at the full keys on a tie.
+template <typename T>
+struct key_traits {
+  static const bool has_prefix = false;
+};
+
+// For strings, the prefix holds the first 7 characters in big-endian order,
+// followed by min(length, 8) in the lowest byte.  Strings of up to 7
+// characters are therefore compared without reading their characters.
+// The prefix does nothing for keys that share their first 7 characters,
+// such as URLs, which all start with "http://" or "https:/": every
+// comparison ties on it and falls back to the full keys, so such keys
+// only pay for the extra 8 bytes per node.  See bench/prefix.cpp.
+template <>
+struct key_traits<std::string> {
+  static const bool has_prefix = true;
+  typedef uint64_t prefix_type;
+
+  static prefix_type prefix(const std::string &s) {
+    prefix_type p = 0;
+    for (std::string::size_type i = 0; i < 7; ++i)
+      p = p << 8 | (i < s.size() ? static_cast<unsigned char>(s[i]) : 0);
+    return p << 8 | (s.size() < 8 ? s.size() : 8);
+  }
+
+  static bool exact(prefix_type p) { return (p & 0xff) < 8; }
+};
+
+// The part of a tree's node that caches the prefix of its key, if any.
+// compare() returns a negative number, zero, or a positive number if key x,
+// whose prefix is this, is less than, equal to, or greater than key y,
+// whose prefix is q.
+template <typename T, bool = key_traits<T>::has_prefix>
+struct key_prefix {
+  explicit key_prefix(const T &) {}
+
+  int compare(const T &x, const key_prefix &, const T &y) const {
+    return x < y ? -1 : x > y ? +1 : 0;
+  }
+
+  bool matches(const T &) const { return true; }
+};
+
 template <typename T>
+struct key_prefix<T, true> {
+  typedef key_traits<T> traits;
+  typename traits::prefix_type prefix;
+
+  explicit key_prefix(const T &x) : prefix(traits::prefix(x)) {}
+
+  int compare(const T &x, const key_prefix &q, const T &y) const {
+    if (prefix != q.prefix) return prefix < q.prefix ? -1 : +1;
+    if (traits::exact(prefix)) return 0;
+    return x < y ? -1 : x > y ? +1 : 0;
+  }
+
+  bool matches(const T &x) const { return prefix == traits::prefix(x); }
+};
+
+// Storage policies decide where a tree's nodes live.  A policy S provides:
+//   S::pointer<N>            a type that behaves like N * for nodes of type N
+//   S::create<N>(near, ...)  constructs a node, preferably close to near
+//   S::destroy(p)            destroys the node pointed to by p
+//   S::concurrent            whether nodes may be created, destroyed and
+//                            accessed from several threads at once
+// The default one keeps nodes in the heap.
+struct heap_storage {
+  template <typename N>
+  using pointer = N *;
+
+  template <typename N, typename... Args>
+  static N *create(N *, const Args &...args) { return new N(args...); }
+
+  template <typename N>
+  static void destroy(N *p) { delete p; }
+
+  static const bool concurrent = true;
+};
+
+// Execution policies for whole-tree traversals: seq runs on the calling
+// thread, par runs on the given number of threads (by default, as many as
+// the hardware supports).
+struct sequenced_policy {};
+struct parallel_policy {
+  unsigned threads;
+};
+const sequenced_policy seq = {};
+const parallel_policy par = {0};
+
+// The background reclaimer: a thread, started on first use, that destroys
+// the nodes of detached subtrees handed to it by trees, so that clearing or
+// destroying a large tree does not stall the thread that does it.  Each
+// job destroys up to a given number of nodes per call, subtracting them from
+// that number, and returns true when it has none left.
+class reclaimer {
+public:
+  typedef std::function<bool(long &)> job;
+
+  // Submits a job that will destroy the given number of nodes.
+  static void submit(job j, long nodes) {
+    state &s = self();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.jobs.push_back(std::move(j));
+    s.backlog += nodes;
+    s.work.notify_one();
+  }
+
+  // Waits until all nodes submitted so far have been destroyed.
+  static void wait() {
+    state &s = self();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.idle.wait(lock, [&s] { return s.jobs.empty() && !s.busy; });
+  }
+
+  // Returns the number of nodes submitted and not yet destroyed.
+  static long backlog() { return self().backlog; }
+
+private:
+  // Nodes destroyed between updates of the backlog.
+  static const long batch = 4096;
+
+  struct state {
+    std::mutex mutex;
+    std::condition_variable work, idle;
+    std::deque<job> jobs;
+    bool busy = false;
+    std::atomic<long> backlog{0};
+  };
+
+  // The state is never destroyed and the thread is detached, so that trees
+  // destroyed during static destruction can still hand their nodes over.
+  static state &self() {
+    static state *s = start();
+    return *s;
+  }
+
+  static state *start() {
+    state *s = new state;
+    std::thread(run, s).detach();
+    return s;
+  }
+
+  static void run(state *s) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    while (true) {
+      s->work.wait(lock, [s] { return !s->jobs.empty(); });
+      job j = std::move(s->jobs.front());
+      s->jobs.pop_front();
+      s->busy = true;
+      lock.unlock();
+      for (bool done = false; !done;) {
+        long n = batch;
+        done = j(n);
+        s->backlog -= batch - n;
+      }
+      lock.lock();
+      s->busy = false;
+      if (s->jobs.empty()) s->idle.notify_all();
+    }
+  }
+};
+
+// Index policies decide whether a tree keeps an index of its nodes by key,
+// besides the tree itself.  A policy I provides:
+//   I::enabled        whether there is an index
+//   I::table<T, L>    the index of a tree with keys of type T, whose nodes
+//                     are pointed to by links of type L
+// With no_index, the default, there is none.  With hash_index, lookup,
+// contains and remove(x) find nodes in O(1) expected time through a hash
+// table instead of descending the tree; ordered access and rebalancing do
+// not use the index.
+struct no_index {
+  static const bool enabled = false;
+
+  template <typename T, typename L>
+  struct table {
+    size_t size() const { return 0; }
+    L find(const T &) const { return nullptr; }
+    void insert(L) {}
+    void erase(const T &) {}
+    void replace(L, L) {}
+    void clear() {}
+  };
+};
+
+// An open-addressing hash table from keys to the nodes that contain them,
+// with linear probing and Fibonacci hashing.  Each slot keeps the hash of
+// its key, so that probing only looks at nodes whose hash matches.  The
+// table is at most half full, and removals shift the following slots back
+// instead of leaving tombstones.
+template <typename T, typename L, typename Hash>
+class hash_table {
+public:
+  hash_table() : used(0), bits(0) {}
+
+  // Returns the number of nodes in the table.
+  size_t size() const { return used; }
+
+  // Returns the node with key x, or nullptr if there is none.
+  L find(const T &x) const {
+    size_t i;
+    return locate(x, Hash()(x), i) ? slots[i].node : L(nullptr);
+  }
+
+  // Adds node t, replacing the node with the same key, if any.
+  void insert(L t) {
+    if (2 * (used + 1) > slots.size()) grow();
+    size_t h = Hash()(t->data), i;
+    if (locate(t->data, h, i)) {
+      slots[i].node = t;
+      return;
+    }
+    slots[i] = slot{h, t};
+    ++used;
+  }
+
+  // Removes the node with key x, if any.
+  void erase(const T &x) {
+    size_t i;
+    if (!locate(x, Hash()(x), i)) return;
+    for (size_t j = (i + 1) & mask(); slots[j].node != nullptr;
+         j = (j + 1) & mask()) {
+      // The slot at j may move back to i unless its home lies in (i, j].
+      size_t k = home(slots[j].hash);
+      if (i <= j ? k <= i || k > j : k <= i && k > j) {
+        slots[i] = slots[j];
+        i = j;
+      }
+    }
+    slots[i] = slot();
+    --used;
+  }
+
+  // Replaces node o with node n, which has the same key.
+  void replace(L o, L n) {
+    size_t i;
+    if (locate(o->data, Hash()(o->data), i)) slots[i].node = n;
+  }
+
+  // Removes all nodes and releases the memory.
+  void clear() {
+    std::vector<slot>().swap(slots);
+    used = 0;
+    bits = 0;
+  }
+
+private:
+  struct slot {
+    size_t hash;
+    L node;
+  };
+
+  std::vector<slot> slots; // 2^bits slots, or none
+  size_t used;
+  int bits;
+
+  size_t mask() const { return slots.size() - 1; }
+
+  size_t home(size_t h) const {
+    return static_cast<size_t>((uint64_t(h) * 0x9e3779b97f4a7c15ull) >>
+                               (64 - bits));
+  }
+
+  // Looks for key x, whose hash is h.  Sets i to its slot and returns
+  // true if it is found, otherwise sets i to the empty slot where it
+  // would be placed and returns false.
+  bool locate(const T &x, size_t h, size_t &i) const {
+    if (slots.empty()) return false;
+    for (i = home(h); slots[i].node != nullptr; i = (i + 1) & mask())
+      if (slots[i].hash == h && !(x < slots[i].node->data) &&
+          !(slots[i].node->data < x))
+        return true;
+    return false;
+  }
+
+  // Doubles the number of slots.
+  void grow() {
+    std::vector<slot> old(bits == 0 ? 16 : slots.size() * 2);
+    old.swap(slots);
+    bits = bits == 0 ? 4 : bits + 1;
+    for (const slot &s : old)
+      if (s.node != nullptr) {
+        size_t i = home(s.hash);
+        while (slots[i].node != nullptr) i = (i + 1) & mask();
+        slots[i] = s;
+      }
+  }
+};
+
+template <template <typename> class Hash = std::hash>
+struct hash_index {
+  static const bool enabled = true;
+
+  template <typename T, typename L>
+  using table = hash_table<T, L, Hash<T>>;
+};
+
+// Reclamation policies decide whether a tree can defer the destruction of
+// the nodes it detaches when it is cleared, assigned or destroyed.  A
+// policy R provides:
+//   D::deferrable     whether defer_reclamation() can be used
+//   D::state<L>       what the tree keeps for it, for links of type L
+// With eager_reclaim, the default, the nodes are always destroyed at once
+// and the tree keeps nothing.  With deferred_reclaim, the tree keeps its
+// budget and its pending nodes.
+struct eager_reclaim {
+  static const bool deferrable = false;
+
+  template <typename L>
+  struct state {};
+};
+
+struct deferred_reclaim {
+  static const bool deferrable = true;
+
+  template <typename L>
+  struct state {
+    state() : budget(-1), garbage(nullptr), size(0) {}
+    // A copy keeps the budget, but has no pending nodes.
+    state(const state &s) : budget(s.budget), garbage(nullptr), size(0) {}
+
+    int budget; // nodes reclaimed per update, or -1 if not deferred
+    L garbage;  // the detached subtrees, chained through parent links
+    int size;   // the number of their nodes
+  };
+};
+
+// Inline storage for the keys of small trees: a sorted array of N keys.
+template <typename T, unsigned N>
+struct small_keys {
+  T keys[N];
+
+  T *data() { return keys; }
+  const T *data() const { return keys; }
+};
+
+template <typename T>
+struct small_keys<T, 0> {
+  T *data() { return nullptr; }
+  const T *data() const { return nullptr; }
+};
+
+// If N > 0, a tree with no more than N keys stores them in a sorted array
+// inside the tree object instead of in nodes.  It is promoted to a real
+// AVL tree, in O(N), when it grows past N keys, and demoted back to the
+// array when it shrinks to N/2 keys.  The tree is small if and only if N > 0
+// and its root is nullptr.
+template <typename T, typename S = heap_storage, unsigned N = 0,
+          typename I = no_index, typename D = eager_reclaim>
 class avltree : public Container<T>, public Iterable<T> {
 public:
   // Constructor: empty tree.
-  avltree() : root(nullptr), the_size(0) {}
+  avltree()
+      : root(nullptr), the_size(0), relaxed(false), budget(0) {}
   // Copy constructor.
-  avltree(const avltree &t) : root(copy(t.root)), the_size(t.the_size) {}
-  // Destructor.
-  virtual ~avltree() override { purge(root); }
+  avltree(const avltree &t)
+      : root(copy(t.root)), the_size(t.the_size), small(t.small),
+        relaxed(t.relaxed), budget(t.budget), pending(t.pending) {
+    reindex();
+  }
+  // Destructor.  With deferred reclamation, the nodes are handed to the
+  // background reclaimer, if the storage policy allows it.
+  virtual ~avltree() override {
+    discard();
+    abandon(deferral());
+  }
 
   // Assignment operator.
   avltree &operator=(const avltree &t) {
-    purge(root);
+    discard();
     root = copy(t.root);
     the_size = t.the_size;
+    small = t.small;
+    relaxed = t.relaxed;
+    budget = t.budget;
+    reindex();
     return *this;
   }
 
@@ -39,17 +421,83 @@ public:
 
   // Clears the tree, removing all nodes.
   virtual void clear() override {
-    purge(root);
+    for (int i = 0; i < the_size && is_small(); ++i) small.data()[i] = T();
+    discard();
     root = nullptr;
     the_size = 0;
+    index.clear();
   }
 
   bool sanity() const {
 	  int n = 0;
+	  if (!index_sanity()) return false;
+	  if (is_small()) return small_sanity();
 	  if (root == nullptr) return n == the_size;
 	  return insanity(root, n) >= 0 && n == the_size; // see private (line 77)
   }
 
+  // Switches to relaxed balance mode.  Insertions and removals only link
+  // or unlink nodes and mark their ancestors as unsettled; no balance
+  // factors are adjusted and no rotations are done.  After each update,
+  // at most budget unsettled nodes are settled, and if an insertion left
+  // its node deeper than about twice the height of a balanced tree, the
+  // whole tree is settled; this bounds the height, even when the keys
+  // arrive in order.  Budget 0 defers all the work to settle(): lookups
+  // and iteration remain correct in the meantime, but the tree's height
+  // is not bounded, and in-order insertions make it a list and take
+  // quadratic time.
+  void relax(int budget = 0) {
+    relaxed = true;
+    this->budget = budget;
+  }
+
+  // Settles the tree and switches back to strict AVL mode.
+  void strict() {
+    settle();
+    relaxed = false;
+  }
+
+  // Restores strict AVL shape by settling all unsettled nodes.
+  // Afterwards, sanity() passes.
+  void settle() { settle(-1); }
+
+  // Returns true if there is no pending rebalancing work.
+  bool settled() const { return root == nullptr || !root->dirty; }
+
+  // Defers reclamation: clear(), assignment and the destructor detach the
+  // tree's nodes in O(1) instead of destroying them.  With budget 0, the
+  // background reclaimer destroys them; otherwise, each later update of
+  // this tree destroys at most budget of them, and the rest are handed to
+  // the background reclaimer when the tree is destroyed.  If the storage
+  // policy is not concurrent, there is no background reclamation: with
+  // budget 0, the nodes wait for reclaim() or the destructor.  This and
+  // the following need the deferred_reclaim policy.
+  void defer_reclamation(int budget = 0) {
+    static_assert(D::deferrable, "needs the deferred_reclaim policy");
+    pending.budget = budget;
+  }
+
+  // Reclaims all pending nodes and switches back to eager reclamation.
+  void eager_reclamation() {
+    reclaim();
+    pending.budget = -1;
+  }
+
+  // Destroys all nodes detached by this tree that are still pending and,
+  // if any were handed to the background reclaimer, waits for it.
+  void reclaim() {
+    static_assert(D::deferrable, "needs the deferred_reclaim policy");
+    collect(pending.size);
+    if (pending.budget == 0 && S::concurrent) reclaimer::wait();
+  }
+
+  // Returns the number of nodes detached by this tree that are pending;
+  // reclaimer::backlog() counts those handed to the background reclaimer.
+  int backlog() const {
+    static_assert(D::deferrable, "needs the deferred_reclaim policy");
+    return pending.size;
+  }
+
 private:
   // Balance type for each node (left-high, equal-high, right-high).
   // Notice that -2 and +2 may also appear, before rebalancing.
@@ -63,23 +511,35 @@ private:
     return static_cast<balance_type>(-b);
   }
 
+  // Pointers to nodes, as defined by the storage policy.
+  struct node;
+  typedef typename S::template pointer<node> link;
+
   // The type of the tree's node.
   // It contains a pointer to the parent, which is nullptr for the tree's root.
-  struct node {
+  // A node is dirty (unsettled) if its subtree has been modified in relaxed
+  // mode and its balance factor is meaningless; all ancestors of a dirty
+  // node are also dirty, and the subtree of a clean node is a valid AVL tree.
+  // The node also caches the prefix of its key, if key_traits<T> says so.
+  // A packed node was placed in a chunk of memory by relayout().
+  struct node : key_prefix<T> {
     T data;
     balance_type balance;
-    node *left, *right, *parent;
+    bool dirty;
+    bool packed;
+    link left, right, parent;
 
-    node(const T &x, node *p = nullptr)
-        : data(x), balance(EH), left(nullptr), right(nullptr), parent(p) {}
+    node(const T &x, link p = nullptr)
+        : key_prefix<T>(x), data(x), balance(EH), dirty(false), packed(false),
+          left(nullptr), right(nullptr), parent(p) {}
   };
 
-  int insanity(node* t, int& n, int depth = 0, node* p = nullptr, T min = 0, T max = 0, bool isleft = 0) const { 
+  int insanity(link t, int& n, int depth = 0, link p = nullptr, T min = T(), T max = T(), bool isleft = 0) const { 
 	  if (t == nullptr) return depth - 1;
 	  bool isBST, isParent, imbCheck, lnewleft; // conditions for each subtree
 	  T lnewmin, lnewmax, rnewmin, rnewmax; // recursion parameters 
 	  n++;
-	  isParent = t->parent == p; // parent - child connections
+	  isParent = t->parent == p && t->matches(t->data); // parent - child connections, cached key prefix
 	  
 	  if (t == root) { // BST check
 		  isBST = 1;
@@ -107,7 +567,7 @@ private:
 	  int l = insanity(t->left, n, depth + 1, t, lnewmin, lnewmax, 1);
 	  int r = insanity(t->right, n, depth + 1, t, rnewmin, rnewmax, 0);
 	  int imb = r - l;
-	  imbCheck = imb == t->balance;
+	  imbCheck = imb == t->balance && !t->dirty;
 	  if (imb <= 1 && imb >= -1 && l >= 0 && r >= 0 && isBST && isParent && imbCheck) // requirements for each subtree
 		  if (l >= r) return l;
 		  else return r;
@@ -121,14 +581,14 @@ private:
   //   child(t, +1) = r;
   //
   // which makes r the right child of node t.
-  static node *&child(node *t, signed char sign) {
+  static link &child(link t, signed char sign) {
     return sign < 0 ? t->left : t->right;
   }
 
   // Replaces old_child with new_child in node t.
   // This assumes that old_child is indeed a child of t.
   // If t is nullptr, it sets the tree's root pointer.
-  void replace_child(node *t, node *old_child, node *new_child) {
+  void replace_child(link t, link old_child, link new_child) {
     if (t == nullptr)
       root = new_child;
     else if (old_child == t->left)
@@ -138,40 +598,147 @@ private:
   }
 
   // The tree's fields.
-  node *root;
+  link root;
   int the_size;
+  small_keys<T, N> small; // the keys of a small tree
+  bool relaxed; // relaxed balance mode
+  int budget;   // nodes settled per update in relaxed mode
+  typename I::template table<T, link> index; // the nodes by key, if indexed
+  typename D::template state<link> pending; // nodes to reclaim, if deferred
+
+  typedef std::integral_constant<bool, D::deferrable> deferral;
+
+  // Creates a node with key x and parent p, close to p.
+  static link create(const T &x, link p) {
+    return S::template create<node>(p, x, p);
+  }
+
+  // Destroys the node pointed to by t.
+  static void destroy(link t) {
+    if (t->packed)
+      release(&*t);
+    else
+      S::destroy(t);
+  }
 
   // Recursively copies the subtree pointed to by t and returns an
   // identical subtree.  The root of the copy will have p as its parent.
-  static node *copy(node *t, node *p = nullptr) {
+  static link copy(link t, link p = nullptr) {
     if (t == nullptr) return nullptr;
-    node *n = new node(t->data, p);
+    link n = create(t->data, p);
     n->left = copy(t->left, n);
     n->right = copy(t->right, n);
     n->balance = t->balance;
+    n->dirty = t->dirty;
     return n;
   }
 
   // Recursively deletes the subtree pointed to by t.
-  static void purge(node *t) {
+  static void purge(link t) {
     if (t != nullptr) {
       purge(t->left);
       purge(t->right);
-      delete t;
+      destroy(t);
     }
   }
 
+  // Destroys the nodes of the detached subtrees chained from t, through
+  // the parent pointers of their roots, until n of them have been destroyed
+  // (subtracting them from n), and returns the rest of the chain.  A node
+  // with a left child is rotated right first, so that no recursion or
+  // stack is needed; this takes O(1) amortized time per node.
+  static link purge(link t, long &n) {
+    while (t != nullptr && n > 0)
+      if (t->left != nullptr) {
+        link l = t->left;
+        t->left = l->right;
+        l->right = t;
+        l->parent = t->parent;
+        t = l;
+      } else {
+        link next = t->parent;
+        if (t->right != nullptr) {
+          next = t->right;
+          next->parent = t->parent;
+        }
+        destroy(t);
+        t = next;
+        --n;
+      }
+    return t;
+  }
+
+  // Destroys the tree's nodes, which are about to be detached, or defers
+  // their reclamation.
+  void discard() { discard(deferral()); }
+
+  void discard(std::false_type) { purge(root); }
+
+  void discard(std::true_type) {
+    if (root == nullptr) return;
+    if (pending.budget < 0) {
+      purge(root);
+    } else if (pending.budget == 0 && S::concurrent) {
+      hand_off(root, the_size);
+    } else {
+      root->parent = pending.garbage;
+      pending.garbage = root;
+      pending.size += the_size;
+    }
+  }
+
+  // Destroys at most n pending nodes.
+  void collect(long n) {
+    long left = n;
+    pending.garbage = purge(pending.garbage, left);
+    pending.size -= n - left;
+  }
+
+  // Before an update, destroys as many pending nodes as the budget allows.
+  void collect_some(std::false_type) {}
+
+  void collect_some(std::true_type) {
+    if (pending.budget > 0) collect(pending.budget);
+  }
+
+  // When the tree is destroyed, hands its pending nodes to the background
+  // reclaimer, or destroys them if the storage policy does not allow it.
+  void abandon(std::false_type) {}
+
+  void abandon(std::true_type) {
+    if (pending.garbage == nullptr) return;
+    if (S::concurrent)
+      hand_off(pending.garbage, pending.size);
+    else
+      collect(pending.size);
+  }
+
+  // Hands the chain of detached subtrees t, with n nodes, to the
+  // background reclaimer.
+  static void hand_off(link t, long n) {
+    reclaimer::submit([t](long &k) mutable {
+      t = purge(t, k);
+      return t == nullptr;
+    }, n);
+  }
+
   // Returns the node with the minimum value in the subtree pointed to by t,
   // i.e., it goes down and to the left until that's not possible.
-  static node *leftdown(node *t) {
+  static link leftdown(link t) {
     if (t == nullptr) return nullptr;
     while (t->left != nullptr) t = t->left;
     return t;
   }
 
+  // Returns the node with the maximum value in the subtree pointed to by t.
+  static link rightdown(link t) {
+    while (t->right != nullptr) t = t->right;
+    return t;
+  }
+
   // Returns the next larger node than those contained in the subtree pointed
   // to by t, i.e., it goes up until it reaches a parent from its left child.
-  static node *leftup(node *t) {
+  static link leftup(link t) {
     while (t->parent != nullptr && t->parent->left != t)
       t = t->parent;
     return t->parent;
@@ -180,14 +747,24 @@ private:
 public:
   // Insert x in the tree.
   void insert(const T &x) {
-    if (root == nullptr) {
-      root = new node(x);
+    collect_some(deferral());
+    if (is_small()) {
+      insert_small(x);
+    } else if (root == nullptr) {
+      root = create(x, nullptr);
+      index.insert(root);
       ++the_size;
     } else {
-      node *p = insert(root, x);
+      link p = insert(root, x);
       if (p != nullptr) {
+        index.insert(p);
         ++the_size;
-        rebalance_after_insert(p);
+        if (relaxed) {
+          mark_dirty(p->parent);
+          if (budget > 0) settle(budget);
+          if (budget > 0 && too_deep(p)) settle();
+        } else
+          rebalance_after_insert(p);
       }
     }
   }
@@ -195,16 +772,18 @@ public:
 private:
   // Insert x in the subtree pointed to by t.
   // Returns the new node, if it was inserted, otherwise nullptr.
-  static node *insert(node *t, const T &x) {
+  static link insert(link t, const T &x) {
+    key_prefix<T> px(x);
     while (true) {
-      if (x < t->data) {
+      int c = px.compare(x, *t, t->data);
+      if (c < 0) {
         if (t->left == nullptr)
-          return (t->left = new node(x, t));
+          return (t->left = create(x, t));
         else
           t = t->left;
-      } else if (x > t->data) {
+      } else if (c > 0) {
         if (t->right == nullptr)
-          return (t->right = new node(x, t));
+          return (t->right = create(x, t));
         else
           t = t->right;
       } else
@@ -213,10 +792,10 @@ private:
   }
 
   // Rebalance the tree after insertion of the specified node.
-  void rebalance_after_insert(node *t) {
+  void rebalance_after_insert(link t) {
     // Adjust balance factor of new node's parent.
     // No rotation will need to be done at this level.
-    node *p = t->parent;
+    link p = t->parent;
     if (p == nullptr) return;
     p->balance = adjust_balance(p->balance, t == p->left ? -1 : +1);
     // If parent did not change in height, nothing more to do.
@@ -252,7 +831,7 @@ private:
    * Indeed, a single node insertion cannot require that more than one
    * (single or double) rotation be done.
    */
-  bool handle_subtree_growth(node *t, node *p, signed char sign) {
+  bool handle_subtree_growth(link t, link p, signed char sign) {
     balance_type old_balance_factor = p->balance;
     balance_type new_balance_factor = adjust_balance(old_balance_factor, sign);
 
@@ -396,10 +975,10 @@ private:
    *
    * This updates pointers but not balance factors!
    */
-  void rotate(node *A, signed char sign) {
-    node *B = child(A, -sign);
-    node *E = child(B, +sign);
-    node *P = A->parent;
+  void rotate(link A, signed char sign) {
+    link B = child(A, -sign);
+    link E = child(B, +sign);
+    link P = A->parent;
 
     child(A, -sign) = E;
     A->parent = B;
@@ -450,11 +1029,11 @@ private:
    * See comment in handle_subtree_growth() for explanation of balance
    * factor updates.
    */
-  node *double_rotate(node *B, node *A, signed char sign) {
-    node *E = child(B, +sign);
-    node *F = child(E, -sign);
-    node *G = child(E, +sign);
-    node *P = A->parent;
+  link double_rotate(link B, link A, signed char sign) {
+    link E = child(B, +sign);
+    link F = child(E, -sign);
+    link G = child(E, +sign);
+    link P = A->parent;
     balance_type e = E->balance;
 
     child(A, -sign) = G;
@@ -496,38 +1075,83 @@ private:
       return ptr == ((TreeIteratorImpl *)&i)->ptr;
     }
 
-    TreeIteratorImpl(node *p) : ptr(p) {}
+    TreeIteratorImpl(link p) : ptr(p) {}
+
+  protected:
+    link ptr;
+    friend class avltree;
+  };
+
+  // Implementation of iterators for small trees: a pointer in the array.
+  class SmallIteratorImpl : public Iterator<T>::Impl {
+  private:
+    typedef typename Iterator<T>::Impl Impl;
+
+  public:
+    Impl *clone() const override { return new SmallIteratorImpl(ptr); }
+    T &access() const override { return *ptr; }
+    void advance() override { ++ptr; }
+    bool equal(const Impl &i) const override {
+      return ptr == ((SmallIteratorImpl *)&i)->ptr;
+    }
+
+    SmallIteratorImpl(T *p) : ptr(p) {}
 
   protected:
-    node *ptr;
-    friend class avltree<T>;
+    T *ptr;
+    friend class avltree;
   };
 
 public:
   Iterator<T> begin() override {
+    if (is_small()) return Iterator<T>(new SmallIteratorImpl(small.data()));
     return Iterator<T>(new TreeIteratorImpl(leftdown(root)));
   }
   Iterator<T> end() override {
+    if (is_small())
+      return Iterator<T>(new SmallIteratorImpl(small.data() + the_size));
     return Iterator<T>(new TreeIteratorImpl(nullptr));
   }
 
   // Searches the tree for key x.  If found, it returns an iterator
   // pointing to it, otherwise it returns end().
   Iterator<T> lookup(const T &x) {
-    return Iterator<T>(new TreeIteratorImpl(lookup(root, x)));
+    if (is_small()) {
+      int i = small_position(x);
+      if (i == the_size || x < small.data()[i]) return end();
+      return Iterator<T>(new SmallIteratorImpl(small.data() + i));
+    }
+    return Iterator<T>(new TreeIteratorImpl(find(x)));
+  }
+
+  // Returns true if key x is in the tree.
+  bool contains(const T &x) const {
+    if (is_small()) {
+      int i = small_position(x);
+      return i < the_size && !(x < small.data()[i]);
+    }
+    return find(x) != nullptr;
   }
 
 private:
+  // Returns the node with key x, or nullptr, using the index if any.
+  link find(const T &x) const {
+    return I::enabled ? index.find(x) : lookup(root, x);
+  }
+
   // Searches the subtree pointed to by t for key x.  If found, it
   // returns the node, otherwise, it returns nullptr.
-  static node *lookup(node *t, const T &x) {
-    while (t != nullptr)
-      if (x < t->data)
+  static link lookup(link t, const T &x) {
+    key_prefix<T> px(x);
+    while (t != nullptr) {
+      int c = px.compare(x, *t, t->data);
+      if (c < 0)
         t = t->left;
-      else if (x > t->data)
+      else if (c > 0)
         t = t->right;
       else
         break;
+    }
     return t;
   }
 
@@ -535,27 +1159,62 @@ public:
   // Removes key x from the tree, if it exists, and returns true.
   // If it does not exist, it does nothing and returns false.
   bool remove(const T& x) {
-    node *t = lookup(root, x);
+    collect_some(deferral());
+    if (is_small()) {
+      int i = small_position(x);
+      if (i == the_size || x < small.data()[i]) return false;
+      remove_small(i);
+      return true;
+    }
+    link t = find(x);
     if (t == nullptr) return false;
+    index.erase(x);
     remove(t);
-    delete t;
+    destroy(t);
     --the_size;
+    if (the_size <= (int)N / 2) demote();
     return true;
   }
 
   // Removes the element pointed to by iterator i.
   void remove(Iterator<T> i) {
-    node *t = dynamic_cast<const TreeIteratorImpl *>(i.getImpl())->ptr;
+    collect_some(deferral());
+    if (is_small()) {
+      T *p = dynamic_cast<const SmallIteratorImpl *>(i.getImpl())->ptr;
+      remove_small(p - small.data());
+      return;
+    }
+    link t = dynamic_cast<const TreeIteratorImpl *>(i.getImpl())->ptr;
+    index.erase(t->data);
     remove(t);
-    delete t;
+    destroy(t);
     --the_size;
+    if (the_size <= (int)N / 2) demote();
   }
 
 private:
   // Removes the node pointed to by t.
-  void remove(node *t) {
-  	node *p;
+  void remove(link t) {
   	bool left_deleted = false;
+  	link p = unlink(t, left_deleted);
+
+  	if (relaxed) {
+  		mark_dirty(p);
+  		if (budget > 0) settle(budget);
+  		return;
+  	}
+
+  	// Rebalance the tree.
+  	while (p != nullptr)
+			p = handle_subtree_shrink(p, left_deleted ? +1 : -1, left_deleted);
+  }
+
+  /* Unlinks the node pointed to by t from the tree, without rebalancing.
+   * Returns the node whose subtree has decreased in height, or nullptr if
+   * the root was unlinked.  left_deleted is set to true if it was the
+   * left subtree of the returned node that shrunk.  */
+  link unlink(link t, bool &left_deleted) {
+  	link p;
 
   	if (t->left != nullptr && t->right != nullptr) {
   		/* node is fully internal, with two children.  Swap it
@@ -575,7 +1234,7 @@ private:
   		 * reflect which child of parent node was.  Or, if
   		 * node was the root node, simply update the root node
   		 * and return.  */
-  		node *child = t->left != nullptr ? t->left : t->right;
+  		link child = t->left != nullptr ? t->left : t->right;
   		p = t->parent;
   		if (p != nullptr) {
   			if (t == p->left) {
@@ -589,21 +1248,16 @@ private:
   		} else {
   			if (child != nullptr) child->parent = p;
   			root = child;
-  			return;
   		}
   	}
-
-  	// Rebalance the tree.
-  	do {
-			p = handle_subtree_shrink(p, left_deleted ? +1 : -1, left_deleted);
-  	} while (p != nullptr);
+  	return p;
   }
 
   /* Swaps node X, which must have 2 children, with its in-order successor, then
    * unlinks node X.  Returns the parent of X just before unlinking, without its
    * balance factor having been updated to account for the unlink.  */
-  node *swap_with_successor(node *X, bool &left_deleted_ret) {
-  	node *Y = X->right, *ret;
+  link swap_with_successor(link X, bool &left_deleted_ret) {
+  	link Y = X->right, ret;
   	if (Y->left == nullptr) {
   		/*
   		 *     P?           P?           P?
@@ -619,7 +1273,7 @@ private:
   		ret = Y;
   		left_deleted_ret = false;
   	} else {
-  		node *Q;
+  		link Q;
   		do {
   			Q = Y;
   			Y = Y->left;
@@ -654,6 +1308,7 @@ private:
   	X->left->parent = Y;
 
     Y->balance = X->balance;
+    Y->dirty = X->dirty;
   	Y->parent = X->parent;
   	replace_child(X->parent, X, Y);
   	return ret;
@@ -684,11 +1339,11 @@ private:
    * parent of p if p is now adequately balanced but has decreased in
    * height by 1.  Also in the latter case, left_deleted_ret will be set.
    */
-  node *handle_subtree_shrink(node *p, signed char sign,
+  link handle_subtree_shrink(link p, signed char sign,
                               bool &left_deleted_ret) {
   	balance_type old_balance_factor = p->balance;
     balance_type new_balance_factor = adjust_balance(old_balance_factor, sign);
-    node *t;
+    link t;
 
   	if (old_balance_factor == EH) {
   		/* Prior to the deletion, the subtree rooted at
@@ -784,4 +1439,815 @@ private:
   	if (p != nullptr) left_deleted_ret = (t == p->left);
   	return p;
   }
+
+  // Marks t and all its ancestors as dirty.  It stops at the first
+  // ancestor that is already dirty, since all of its ancestors are too.
+  static void mark_dirty(link t) {
+    while (t != nullptr && !t->dirty) {
+      t->dirty = true;
+      t = t->parent;
+    }
+  }
+
+  // Returns true if t is deeper than twice the height of a perfectly
+  // balanced tree of the same size, plus two.
+  bool too_deep(link t) const {
+    int limit = 2;
+    for (int n = the_size; n > 0; n /= 2) limit += 2;
+    int d = 0;
+    for (; t != nullptr && d <= limit; t = t->parent) ++d;
+    return d > limit;
+  }
+
+  // Returns the height of the clean subtree pointed to by t, following
+  // the taller child at each level.
+  static int height(link t) {
+    int h = 0;
+    for (; t != nullptr; ++h) t = t->balance < 0 ? t->left : t->right;
+    return h;
+  }
+
+  /*
+   * Joins the subtrees of node k into a single AVL subtree.
+   *
+   * k: a node whose left and right subtrees are valid AVL trees of
+   *    arbitrary heights; its own balance factor is ignored.
+   * P: parent of k; nullptr if k is the tree's root.
+   *
+   * If the heights of the two subtrees differ by at most one, only k's
+   * balance factor is set.  Otherwise, the taller subtree takes k's place,
+   * k is hung from its inner spine at the first node whose height is at
+   * most one more than the shorter subtree's, and the subtree rooted at k
+   * is then treated as if it had grown by an insertion.  This takes time
+   * proportional to the heights of the two subtrees, which are computed.
+   *
+   * Returns the new root of the joined subtree.
+   */
+  link join(link k, link P) {
+    int h;
+    return join(k, P, height(k->left), height(k->right), h);
+  }
+
+  // The same, given the heights hl and hr of k's subtrees, so that it takes
+  // time proportional to their difference.  Sets h to the height of the
+  // joined subtree.
+  link join(link k, link P, int hl, int hr, int &h) {
+    if (hl - hr <= 1 && hr - hl <= 1) {
+      k->balance = static_cast<balance_type>(hr - hl);
+      h = 1 + (hl > hr ? hl : hr);
+      return k;
+    }
+
+    // sign > 0: the left subtree is taller, descend along its right spine;
+    // sign < 0: the right subtree is taller, descend along its left spine.
+    signed char sign = hl > hr ? +1 : -1;
+    link tall = child(k, -sign), low = child(k, sign);
+    int htall = sign > 0 ? hl : hr, hlow = sign > 0 ? hr : hl;
+    h = htall;
+    bool left = P != nullptr && P->left == k;
+
+    tall->parent = P;
+    replace_child(P, k, tall);
+
+    link q, c = tall;
+    do {
+      q = c;
+      h -= sign * c->balance >= 0 ? 1 : 2;
+      c = child(c, sign);
+    } while (h > hlow + 1);
+
+    child(q, sign) = k;
+    k->parent = q;
+    child(k, -sign) = c;
+    if (c != nullptr) c->parent = k;
+    child(k, sign) = low;
+    k->balance = static_cast<balance_type>(sign * (hlow - h));
+
+    // The subtree rooted at k is one higher than the one rooted at c.
+    // If the growth is not absorbed below P, so is the joined subtree.
+    link t = k, p = q;
+    while (p != P && !handle_subtree_growth(t, p, t == p->left ? -1 : +1)) {
+      t = p;
+      p = p->parent;
+    }
+    h = p == P ? htall + 1 : htall;
+    return P == nullptr ? root : left ? P->left : P->right;
+  }
+
+  // Settles at most n dirty nodes (all of them, if n < 0), in post-order,
+  // joining the two clean subtrees of each one.
+  void settle(int n) {
+    link t = root;
+    while (t != nullptr && t->dirty && n != 0) {
+      while (true)
+        if (t->left != nullptr && t->left->dirty)
+          t = t->left;
+        else if (t->right != nullptr && t->right->dirty)
+          t = t->right;
+        else
+          break;
+      link p = t->parent;
+      t->dirty = false;
+      join(t, p);
+      if (n > 0) --n;
+      t = p != nullptr ? p : root;
+    }
+  }
+
+public:
+  // An update in a batch: inserts key if insert is true, otherwise removes it.
+  struct update {
+    T key;
+    bool insert;
+  };
+
+  // Applies a batch of updates and returns, for each one, whether it
+  // changed the tree (i.e., whether the key was inserted or removed).
+  // Updates on the same key take effect in the order they appear in ops.
+  // The batch is sorted and applied top-down: at each node, the batch is
+  // split by the node's key, the two halves are applied to the node's
+  // subtrees (in parallel, for large batches) and the results are joined.
+  // This takes O(m log(n/m + 1)) work for m updates in a tree of size n.
+  // A relaxed tree is settled first.  The index, if any, forgets the keys
+  // of the batch before it is applied and finds them in the tree after.
+  std::vector<bool> apply_batch(const std::vector<update> &ops) {
+    collect_some(deferral());
+    promote();
+    settle();
+    for (int i = 0; i < (int)ops.size() && I::enabled; ++i)
+      index.erase(ops[i].key);
+    std::vector<int> idx(ops.size());
+    for (int i = 0; i < (int)idx.size(); ++i) idx[i] = i;
+    std::stable_sort(idx.begin(), idx.end(), [&ops](int i, int j) {
+      return ops[i].key < ops[j].key;
+    });
+    std::vector<char> res(ops.size());
+    // Asking for the number of hardware threads takes microseconds, so
+    // small batches, which are never forked, skip it.
+    int depth = 0;
+    if (S::concurrent && (int)ops.size() >= parallel_cutoff)
+      for (unsigned n = std::thread::hardware_concurrency(); n > 1; n /= 2)
+        ++depth;
+    int h;
+    root = apply(root, height(root), ops, idx.data(), idx.data() + idx.size(),
+                 res.data(), depth, h);
+    if (root != nullptr) root->parent = nullptr;
+    for (int i = 0; i < (int)ops.size(); ++i)
+      if (res[i]) the_size += ops[i].insert ? +1 : -1;
+    for (int i = 0; i < (int)ops.size() && I::enabled; ++i) {
+      link t = lookup(root, ops[i].key);
+      if (t != nullptr) index.insert(t);
+    }
+    if (the_size <= (int)N / 2) demote();
+    return std::vector<bool>(res.begin(), res.end());
+  }
+
+private:
+  // Batches smaller than this are applied sequentially.
+  static const int parallel_cutoff = 4096;
+
+  // Applies the updates ops[*lo], ..., ops[*(hi-1)], sorted by key, to the
+  // detached subtree pointed to by t, of height ht, records in res whether
+  // each one succeeded, and returns the root of the resulting subtree and
+  // its height in h.  Heights are passed along, so that each join takes
+  // time proportional to the difference of the heights it joins.  Up to
+  // depth levels of recursion fork a task for the left subtree.
+  static link apply(link t, int ht, const std::vector<update> &ops,
+                    const int *lo, const int *hi, char *res, int depth,
+                    int &h) {
+    h = ht;
+    if (lo == hi) return t;
+    if (t == nullptr) {
+      std::vector<T> keys;
+      for (const int *i = lo; i != hi;) {
+        const int *j = i;
+        bool present = false;
+        for (; j != hi && !(ops[*i].key < ops[*j].key); ++j)
+          present = apply(ops[*j], present, res[*j]);
+        if (present) keys.push_back(ops[*i].key);
+        i = j;
+      }
+      h = perfect_height(keys.size());
+      return build(keys.data(), keys.size());
+    }
+
+    auto less = [&ops](const T &x, int i) { return x < ops[i].key; };
+    auto greater = [&ops](int i, const T &x) { return ops[i].key < x; };
+    const int *mid = std::lower_bound(lo, hi, t->data, greater);
+    const int *high = std::upper_bound(mid, hi, t->data, less);
+
+    link L = t->left, R = t->right;
+    int hl = left_height(t, ht), hr = right_height(t, ht);
+    if (L != nullptr) L->parent = nullptr;
+    if (R != nullptr) R->parent = nullptr;
+    if (S::concurrent && depth > 0 && hi - lo >= parallel_cutoff) {
+      int hll;
+      auto left = std::async(std::launch::async, [=, &ops, &hll]() {
+        return apply(L, hl, ops, lo, mid, res, depth - 1, hll);
+      });
+      R = apply(R, hr, ops, high, hi, res, depth - 1, hr);
+      L = left.get();
+      hl = hll;
+    } else {
+      L = apply(L, hl, ops, lo, mid, res, depth, hl);
+      R = apply(R, hr, ops, high, hi, res, depth, hr);
+    }
+
+    bool present = true;
+    for (const int *i = mid; i != high; ++i)
+      present = apply(ops[*i], present, res[*i]);
+    if (present) return join(L, hl, t, R, hr, h);
+    destroy(t);
+    return concat(L, hl, R, hr, h);
+  }
+
+  // Returns the heights of the left and right subtrees of t, given its
+  // height ht.
+  static int left_height(link t, int ht) {
+    return ht - (t->balance > 0 ? 2 : 1);
+  }
+  static int right_height(link t, int ht) {
+    return ht - (t->balance < 0 ? 2 : 1);
+  }
+
+  // Applies a single update to a key that is present or not, records in
+  // done whether it succeeded, and returns whether the key is present after.
+  static bool apply(const update &op, bool present, char &done) {
+    done = op.insert != present;
+    return op.insert;
+  }
+
+  // Builds a perfectly balanced subtree out of the n sorted keys and
+  // returns its root, whose parent will be p.
+  static link build(const T *keys, int n, link p = nullptr) {
+    if (n == 0) return nullptr;
+    int m = n / 2;
+    link t = create(keys[m], p);
+    t->left = build(keys, m, t);
+    t->right = build(keys + m + 1, n - m - 1, t);
+    t->balance = static_cast<balance_type>(perfect_height(n - m - 1) -
+                                           perfect_height(m));
+    return t;
+  }
+
+  // Returns the height of a perfectly balanced tree with n nodes.
+  static int perfect_height(int n) {
+    int h = 0;
+    for (; n > 0; n /= 2) ++h;
+    return h;
+  }
+
+  // Joins the detached AVL subtrees L and R, of heights hl and hr, with
+  // node k in between, and returns the root of the result and its height
+  // in h.  A scratch tree owns the nodes while they are rebalanced, so that
+  // concurrent joins do not interfere.
+  static link join(link L, int hl, link k, link R, int hr, int &h) {
+    avltree w;
+    w.root = k;
+    k->parent = nullptr;
+    k->left = L;
+    k->right = R;
+    if (L != nullptr) L->parent = k;
+    if (R != nullptr) R->parent = k;
+    w.join(k, nullptr, hl, hr, h);
+    link t = w.root;
+    w.root = nullptr;
+    return t;
+  }
+
+  // Concatenates the detached AVL subtrees L and R, of heights hl and hr,
+  // using the minimum of R as the node in between, and returns the root of
+  // the result and its height in h.
+  static link concat(link L, int hl, link R, int hr, int &h) {
+    h = hl > hr ? hl : hr;
+    if (L == nullptr) return R;
+    if (R == nullptr) return L;
+    link k;
+    R = remove_min(R, hr, k, hr);
+    return join(L, hl, k, R, hr, h);
+  }
+
+  // Detaches the minimum of the detached AVL subtree t, of height ht, into
+  // k, and returns the root of the rest and its height in h.  The rest is
+  // rebuilt by joins along the left spine, each of subtrees whose heights
+  // differ by at most two, so this takes time proportional to ht.
+  static link remove_min(link t, int ht, link &k, int &h) {
+    link L = t->left, R = t->right;
+    if (R != nullptr) R->parent = nullptr;
+    if (L == nullptr) {
+      k = t;
+      t->right = nullptr;
+      h = ht - 1;
+      return R;
+    }
+    int hr = right_height(t, ht);
+    L->parent = nullptr;
+    L = remove_min(L, left_height(t, ht), k, h);
+    return join(L, h, t, R, hr, h);
+  }
+
+public:
+  // Moves all nodes to contiguous memory, in van Emde Boas order: the top
+  // half of the tree's levels is laid out first, recursively in the same
+  // order, followed by each of the subtrees hanging from it.  A lookup
+  // thus touches few cache lines and pages.  The tree remains fully
+  // mutable, but iterators are invalidated.  A relaxed tree is settled.
+  void relayout() {
+    settle();
+    relocate(root, height(root));
+  }
+
+  // The position of an incremental relayout in the tree.  The caller keeps
+  // it between calls, so that trees that are never relaid out do not pay
+  // for it; a new cursor starts a new pass.
+  struct relayout_cursor {
+    relayout_cursor() : band(0), valid(false) {}
+
+    int band;   // the first level of the band being relaid out
+    T key;      // the largest key relaid out in that band
+    bool valid; // whether the band has been started
+  };
+
+  // Incremental relayout: moves roughly budget nodes to contiguous memory.
+  // The tree is cut in bands of k levels, where 2^k - 1 <= budget, and each
+  // band in blocks, i.e., the k top levels of the subtrees rooted at its
+  // first level.  The blocks are moved one at a time, each in van Emde Boas
+  // order, from the top band down and in key order within a band, starting
+  // from cursor c, until budget nodes have been moved.  Returns true when a
+  // pass over the whole tree is complete; c is then ready for the next one.
+  bool relayout(relayout_cursor &c, int budget) {
+    settle();
+    int h = height(root), k = 1;
+    while (k < h && (2 << k) - 1 <= budget) ++k;
+    int work = 0;
+    while (c.band < h) {
+      if (relocate_after(c, root, 0, k, budget, work)) return false;
+      c.band += k;
+      c.valid = false;
+    }
+    c.band = 0;
+    return true;
+  }
+
+private:
+  // Packed nodes live in chunks, aligned to their size, which are shared by
+  // all trees of this type: each relocation fills the current chunk from
+  // where the previous one stopped.  Each chunk starts with a header that
+  // counts its live nodes and points back to its slab, i.e., the block of
+  // slab_chunks chunks that it was carved from.  A chunk whose nodes have
+  // all been released is reused, and a slab whose chunks are all unused is
+  // freed.
+  struct slab;
+  struct chunk {
+    std::atomic<long> live;
+    slab *owner;
+    chunk *prev, *next; // neighbors in the list of unused chunks
+  };
+  struct slab {
+    void *memory;
+    int unused;
+  };
+  static const size_t chunk_size = 1 << 16;
+  static const int slab_chunks = 16;
+  static const size_t chunk_header =
+      (sizeof(chunk) + alignof(node) - 1) / alignof(node) * alignof(node);
+  static const size_t chunk_slots = (chunk_size - chunk_header) / sizeof(node);
+
+  // The chunks: the one being filled, which holds one extra count so that
+  // it is not reused meanwhile, and the unused ones.
+  struct chunk_pool {
+    std::mutex mutex;
+    chunk *current = nullptr;
+    size_t used = 0; // slots taken in the current chunk
+    chunk *unused = nullptr;
+  };
+
+  // The pool is never destroyed, so that nodes released during static
+  // destruction can still return their chunks to it.
+  static chunk_pool &pool() {
+    static chunk_pool *p = new chunk_pool;
+    return *p;
+  }
+
+  // Destroys a packed node.
+  static void release(node *n) {
+    n->~node();
+    chunk *c = reinterpret_cast<chunk *>(reinterpret_cast<uintptr_t>(n) &
+                                         ~(chunk_size - 1));
+    if (--c->live == 0) {
+      chunk_pool &p = pool();
+      std::lock_guard<std::mutex> lock(p.mutex);
+      recycle(p, c);
+    }
+  }
+
+  // Makes the next chunk of the pool current, carving a new slab if there
+  // is no unused chunk; the pool's mutex must be held.
+  static void next_chunk(chunk_pool &p) {
+    if (p.current != nullptr && --p.current->live == 0) recycle(p, p.current);
+    if (p.unused == nullptr) {
+      slab *s = new slab;
+      s->memory = ::operator new((slab_chunks + 1) * chunk_size);
+      s->unused = slab_chunks;
+      for (int i = 0; i < slab_chunks; ++i) {
+        chunk *c = new (nth_chunk(s, i)) chunk;
+        c->live = 0;
+        c->owner = s;
+        push_unused(p, c);
+      }
+    }
+    chunk *c = p.unused;
+    p.unused = c->next;
+    if (p.unused != nullptr) p.unused->prev = nullptr;
+    --c->owner->unused;
+    c->live = 1;
+    p.current = c;
+    p.used = 0;
+  }
+
+  // Returns the chunk c, which has no live nodes, to the unused ones, and
+  // frees its slab if all of the slab's chunks are unused; the pool's
+  // mutex must be held.
+  static void recycle(chunk_pool &p, chunk *c) {
+    push_unused(p, c);
+    slab *s = c->owner;
+    if (++s->unused < slab_chunks) return;
+    for (int i = 0; i < slab_chunks; ++i) {
+      chunk *d = nth_chunk(s, i);
+      if (d->prev != nullptr)
+        d->prev->next = d->next;
+      else
+        p.unused = d->next;
+      if (d->next != nullptr) d->next->prev = d->prev;
+      d->~chunk();
+    }
+    ::operator delete(s->memory);
+    delete s;
+  }
+
+  // Adds the chunk c to the front of the list of unused chunks.
+  static void push_unused(chunk_pool &p, chunk *c) {
+    c->prev = nullptr;
+    c->next = p.unused;
+    if (p.unused != nullptr) p.unused->prev = c;
+    p.unused = c;
+  }
+
+  // Returns the address of the i-th chunk of slab s.
+  static chunk *nth_chunk(slab *s, int i) {
+    uintptr_t base = (reinterpret_cast<uintptr_t>(s->memory) +
+                      chunk_size - 1) & ~(chunk_size - 1);
+    return reinterpret_cast<chunk *>(base + i * chunk_size);
+  }
+
+  // Appends the nodes of the first levels levels of the subtree pointed to
+  // by t to order, in van Emde Boas order, with their depths below t
+  // (plus d) in depths.
+  static void veb(link t, int levels, int d, std::vector<link> &order,
+                  std::vector<int> &depths) {
+    if (t == nullptr || levels == 0) return;
+    if (levels == 1) {
+      order.push_back(t);
+      depths.push_back(d);
+      return;
+    }
+    int top = levels / 2;
+    veb(t, top, d, order, depths);
+    std::vector<link> bottom;
+    below(t, top, bottom);
+    for (link b : bottom) veb(b, levels - top, d + top, order, depths);
+  }
+
+  // Appends the nodes exactly d levels below t to v, in key order.
+  static void below(link t, int d, std::vector<link> &v) {
+    if (t == nullptr) return;
+    if (d == 0) {
+      v.push_back(t);
+      return;
+    }
+    below(t->left, d - 1, v);
+    below(t->right, d - 1, v);
+  }
+
+  // Moves the first levels levels of the subtree pointed to by t to new
+  // nodes, in van Emde Boas order, and returns the number of nodes moved.
+  int relocate(link t, int levels) {
+    std::vector<link> order;
+    std::vector<int> depths;
+    veb(t, levels, 0, order, depths);
+    if (order.empty()) return 0;
+    link P = t->parent;
+
+    // Make the copies and let each old node's parent point to its copy.
+    std::vector<link> copies = pack(order, std::is_pointer<link>());
+    for (size_t i = 0; i < order.size(); ++i) {
+      link o = order[i], n = copies[i];
+      n->balance = o->balance;
+      n->dirty = o->dirty;
+      n->left = o->left;
+      n->right = o->right;
+      o->parent = n;
+      index.replace(o, n);
+    }
+    // Redirect the links of the copies; children below the levels moved
+    // keep their nodes but get a new parent.
+    for (size_t i = 0; i < copies.size(); ++i) {
+      link n = copies[i];
+      bool inside = depths[i] + 1 < levels;
+      if (n->left != nullptr) {
+        if (inside) n->left = n->left->parent;
+        n->left->parent = n;
+      }
+      if (n->right != nullptr) {
+        if (inside) n->right = n->right->parent;
+        n->right->parent = n;
+      }
+    }
+    copies[0]->parent = P;
+    replace_child(P, t, copies[0]);
+    for (link o : order) destroy(o);
+    return order.size();
+  }
+
+  // Copies the keys of the given nodes to packed nodes, which are placed
+  // consecutively in the pool's chunks.
+  static std::vector<link> pack(const std::vector<link> &order,
+                                std::true_type) {
+    static_assert(chunk_slots > 0, "node too large to be packed");
+    chunk_pool &p = pool();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    std::vector<link> copies;
+    for (link o : order) {
+      if (p.current == nullptr || p.used == chunk_slots) next_chunk(p);
+      char *slot = reinterpret_cast<char *>(p.current) + chunk_header +
+                   p.used++ * sizeof(node);
+      node *n = new (slot) node(o->data);
+      n->packed = true;
+      ++p.current->live;
+      copies.push_back(n);
+    }
+    return copies;
+  }
+
+  // Copies the keys of the given nodes to new nodes, each of which is
+  // created by the storage policy next to the previous one.
+  static std::vector<link> pack(const std::vector<link> &order,
+                                std::false_type) {
+    std::vector<link> copies;
+    link near = nullptr;
+    for (link o : order) {
+      near = S::template create<node>(near, o->data, link());
+      copies.push_back(near);
+    }
+    return copies;
+  }
+
+  // Relocates, in key order, the blocks rooted at level c.band below t
+  // (whose depth is depth) that follow cursor c, each with k levels, until
+  // budget nodes have been moved.  Returns true if it stopped because of
+  // the budget.
+  bool relocate_after(relayout_cursor &c, link t, int depth, int k,
+                      int budget, int &work) {
+    if (t == nullptr) return false;
+    if (depth == c.band) {
+      if (c.valid && !(c.key < leftdown(t)->data)) return false;
+      c.key = rightdown(t)->data;
+      c.valid = true;
+      work += relocate(t, k);
+      return work >= budget;
+    }
+    if (!c.valid || c.key < t->data)
+      if (relocate_after(c, t->left, depth + 1, k, budget, work))
+        return true;
+    return relocate_after(c, t->right, depth + 1, k, budget, work);
+  }
+
+public:
+  // Calls f on every key, in order.
+  template <typename F>
+  void for_each(sequenced_policy, F f) const {
+    for (int i = 0; i < the_size && is_small(); ++i) f(small.data()[i]);
+    if (root != nullptr) visit(piece{root, 1}, [&f](link t) { f(t->data); });
+  }
+
+  // Calls f on every key, on several threads; the order is unspecified.
+  template <typename F>
+  void for_each(parallel_policy policy, F f) const {
+    if (is_small()) return for_each(seq, f);
+    unsigned threads = resolve(policy);
+    std::vector<piece> pieces = split(threads);
+    run(threads, pieces.size(), [&](size_t i) {
+      visit(pieces[i], [&f](link t) { f(t->data); });
+    });
+  }
+
+  // Returns init op k1 op k2 op ... op kn, where k1 < k2 < ... < kn are
+  // the keys.  With the parallel policy, op must be associative.
+  template <typename P, typename R, typename Op>
+  R reduce(P policy, R init, Op op) const {
+    return transform_reduce(policy, init, op, [](const T &x) { return x; });
+  }
+
+  // Returns init op f(k1) op f(k2) op ... op f(kn), where k1 < k2 < ... < kn
+  // are the keys.  With the parallel policy, op must be associative.
+  template <typename R, typename Op, typename F>
+  R transform_reduce(sequenced_policy, R init, Op op, F f) const {
+    for (int i = 0; i < the_size && is_small(); ++i)
+      init = op(init, f(small.data()[i]));
+    if (root != nullptr)
+      visit(piece{root, 1}, [&](link t) { init = op(init, f(t->data)); });
+    return init;
+  }
+
+  template <typename R, typename Op, typename F>
+  R transform_reduce(parallel_policy policy, R init, Op op, F f) const {
+    if (is_small()) return transform_reduce(seq, init, op, f);
+    unsigned threads = resolve(policy);
+    std::vector<piece> pieces = split(threads);
+    std::vector<R> partial(pieces.size(), init);
+    run(threads, pieces.size(), [&](size_t i) {
+      bool first = true;
+      visit(pieces[i], [&](link t) {
+        partial[i] = first ? R(f(t->data)) : op(partial[i], f(t->data));
+        first = false;
+      });
+    });
+    for (const R &r : partial) init = op(init, r);
+    return init;
+  }
+
+private:
+  // Pieces per thread in parallel traversals, for load balancing.
+  static const unsigned pieces_per_thread = 8;
+
+  // A piece of the tree, for parallel traversals: the whole subtree
+  // pointed to by t, whose estimated height is h, or only its root, if
+  // h is 0.
+  struct piece {
+    link t;
+    int h;
+  };
+
+  // Calls g on every node of piece p, in order.
+  template <typename G>
+  static void visit(const piece &p, G g) {
+    if (p.h == 0) {
+      g(p.t);
+      return;
+    }
+    link last = rightdown(p.t);
+    for (link t = leftdown(p.t);; t = t->right != nullptr ? leftdown(t->right)
+                                                          : leftup(t)) {
+      g(t);
+      if (t == last) break;
+    }
+  }
+
+  // Splits the tree in pieces, in key order, by repeatedly replacing the
+  // highest subtree with its left subtree, its root and its right subtree,
+  // until there are enough pieces for the given number of threads.
+  std::vector<piece> split(unsigned threads) const {
+    std::vector<piece> pieces;
+    if (root != nullptr) pieces.push_back(piece{root, height(root)});
+    while (pieces.size() < threads * pieces_per_thread) {
+      size_t best = 0;
+      for (size_t i = 1; i < pieces.size(); ++i)
+        if (pieces[i].h > pieces[best].h) best = i;
+      if (pieces.empty() || pieces[best].h <= 1) break;
+      link t = pieces[best].t;
+      int h = pieces[best].h;
+      std::vector<piece> parts;
+      if (t->left != nullptr)
+        parts.push_back(piece{t->left, std::max(h - (t->balance > 0 ? 2 : 1), 1)});
+      parts.push_back(piece{t, 0});
+      if (t->right != nullptr)
+        parts.push_back(piece{t->right, std::max(h - (t->balance < 0 ? 2 : 1), 1)});
+      pieces.erase(pieces.begin() + best);
+      pieces.insert(pieces.begin() + best, parts.begin(), parts.end());
+    }
+    return pieces;
+  }
+
+  // Returns the number of threads to use for a parallel traversal.
+  static unsigned resolve(parallel_policy policy) {
+    unsigned threads = policy.threads;
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    return S::concurrent && threads > 0 ? threads : 1;
+  }
+
+  // Runs task(0), ..., task(n-1) on the given number of threads, each of
+  // which takes the next task to run from a shared counter.  The first
+  // exception thrown by a task is rethrown at the end.
+  template <typename Task>
+  static void run(unsigned threads, size_t n, Task task) {
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    auto work = [&]() {
+      for (size_t i; (i = next++) < n && !failed;)
+        try {
+          task(i);
+        } catch (...) {
+          if (!failed.exchange(true)) error = std::current_exception();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads && i < n; ++i) pool.emplace_back(work);
+    work();
+    for (std::thread &t : pool) t.join();
+    if (error) std::rethrow_exception(error);
+  }
+
+private:
+  // Returns true if the keys are stored in the array.
+  bool is_small() const { return N > 0 && root == nullptr; }
+
+  // Returns the position of the first key in the array that is not less
+  // than x.  The scan has no early exit, so that it can be vectorized.
+  int small_position(const T &x) const {
+    int i = 0;
+    for (int j = 0; j < the_size; ++j) i += small.data()[j] < x;
+    return i;
+  }
+
+  // Inserts x in the array, promoting the tree if the array is full.
+  void insert_small(const T &x) {
+    T *keys = small.data();
+    int i = small_position(x);
+    if (i < the_size && !(x < keys[i])) return;
+    if (the_size == (int)N) {
+      std::vector<T> all(keys, keys + i);
+      all.push_back(x);
+      all.insert(all.end(), keys + i, keys + the_size);
+      for (int j = 0; j < the_size; ++j) keys[j] = T();
+      root = build(all.data(), all.size());
+      ++the_size;
+      reindex();
+      return;
+    }
+    for (int j = the_size; j > i; --j) keys[j] = keys[j - 1];
+    keys[i] = x;
+    ++the_size;
+  }
+
+  // Removes the key at position i of the array.
+  void remove_small(int i) {
+    T *keys = small.data();
+    for (--the_size; i < the_size; ++i) keys[i] = keys[i + 1];
+    keys[the_size] = T();
+  }
+
+  // Moves the keys of a small tree to nodes.
+  void promote() {
+    if (!is_small() || the_size == 0) return;
+    root = build(small.data(), the_size);
+    for (int i = 0; i < the_size; ++i) small.data()[i] = T();
+    reindex();
+  }
+
+  // Moves the keys of the tree to the array, if it is not small.
+  void demote() {
+    if (N == 0 || root == nullptr) return;
+    int i = 0;
+    for_each(seq, [&](const T &x) { small.data()[i++] = x; });
+    purge(root);
+    root = nullptr;
+    index.clear();
+  }
+
+  // The sanity check of a small tree: the keys are strictly increasing.
+  bool small_sanity() const {
+    const T *keys = small.data();
+    if (the_size < 0 || the_size > (int)N) return false;
+    for (int i = 1; i < the_size; ++i)
+      if (!(keys[i - 1] < keys[i])) return false;
+    return true;
+  }
+
+  // Rebuilds the index, if any, from the nodes of the tree.
+  void reindex() {
+    if (!I::enabled) return;
+    index.clear();
+    if (root != nullptr)
+      visit(piece{root, 1}, [this](link t) { index.insert(t); });
+  }
+
+  // The sanity check of the index: it holds exactly the nodes of the tree.
+  bool index_sanity() const {
+    if (!I::enabled) return true;
+    size_t n = 0;
+    bool sane = true;
+    if (root != nullptr)
+      visit(piece{root, 1}, [&](link t) {
+        sane = sane && index.find(t->data) == t;
+        ++n;
+      });
+    return sane && index.size() == n;
+  }
+
+  // Blocked trees are trees of blocks that manage their own nodes.
+  template <typename, unsigned>
+  friend class blocked_avltree;
 };
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef BLOCKED_HPP
+#define BLOCKED_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include "avltree.hpp"
+
+/* Blocked AVL trees, whose nodes hold sorted blocks of up to B keys:
+ *
+ *   blocked_avltree<int> t;  // 16 keys per block, i.e., one cache line
+ *
+ * The blocks are kept in an avltree of blocks, ordered by their key ranges,
+ * and the tree is rebalanced by the same code, so it is about log2(B) levels
+ * shallower than an avltree with the same keys.  A search descends by the
+ * first key of each block and ends at the only block that can contain the
+ * key, which it then searches.  When an insertion overflows a block, its
+ * upper half is moved to a new block, inserted right after it.  When a
+ * removal leaves a block less than a quarter full, it is merged with an
+ * adjacent block, or keys are moved from that block if both do not fit in
+ * one.  Every block but the only one is thus at least a quarter full.
+ *
+ * For arithmetic keys, the unused slots of a block are filled with the
+ * largest value of the type, and a block is searched by counting the keys
+ * less than the searched one in all B slots.  The count has no branches and
+ * a fixed length, so the compiler turns it into SIMD code (for 64-bit keys,
+ * this needs SSE4.2 or AVX2 on x86-64).  Other keys are searched by binary
+ * search.
+ */
+
+// A sorted block of up to B keys.  Blocks are ordered by their key ranges,
+// which never overlap in a tree; blocks that overlap compare equal.
+template <typename T, unsigned B>
+struct key_block {
+  static_assert(B >= 2, "blocks must hold at least two keys");
+
+  // Whether unused slots are filled, so that searches can scan all of them.
+  static const bool padded = std::is_arithmetic<T>::value;
+
+  T keys[B];
+  unsigned count;
+
+  key_block() : count(0) {
+    for (unsigned i = 0; i < B; ++i) keys[i] = unused();
+  }
+
+  // The value of unused slots: one that no key is greater than.
+  static T unused() {
+    typedef std::numeric_limits<T> limits;
+    if (!padded) return T();
+    return limits::has_infinity ? limits::infinity() : limits::max();
+  }
+
+  // Returns the position of the first key that is not less than x.
+  unsigned rank(const T &x) const {
+    if (!padded) return std::lower_bound(keys, keys + count, x) - keys;
+    // A counter as wide as the keys lets their comparisons share lanes.
+    typename std::conditional<(sizeof(T) > 4), uint64_t, unsigned>::type n = 0;
+    for (unsigned i = 0; i < B; ++i) n += keys[i] < x;
+    return n;
+  }
+
+  // Returns true if the key at position i is x.
+  bool holds(unsigned i, const T &x) const {
+    return i < count && !(x < keys[i]);
+  }
+
+  // Inserts x at position i, which must be free.
+  void insert(unsigned i, const T &x) {
+    for (unsigned j = count; j > i; --j) keys[j] = keys[j - 1];
+    keys[i] = x;
+    ++count;
+  }
+
+  // Removes the n keys starting at position i.
+  void erase(unsigned i, unsigned n = 1) {
+    for (unsigned j = i + n; j < count; ++j) keys[j - n] = keys[j];
+    for (unsigned j = count - n; j < count; ++j) keys[j] = unused();
+    count -= n;
+  }
+
+  // Moves the last n keys of a to the front of b.
+  static void shift_right(key_block &a, key_block &b, unsigned n) {
+    for (unsigned j = b.count; j-- > 0;) b.keys[j + n] = b.keys[j];
+    for (unsigned j = 0; j < n; ++j) b.keys[j] = a.keys[a.count - n + j];
+    b.count += n;
+    a.erase(a.count - n, n);
+  }
+
+  // Moves the first n keys of b to the back of a.
+  static void shift_left(key_block &a, key_block &b, unsigned n) {
+    for (unsigned j = 0; j < n; ++j) a.keys[a.count + j] = b.keys[j];
+    a.count += n;
+    b.erase(0, n);
+  }
+
+  // The invariants of a block: it holds between least and B keys, which
+  // are strictly increasing, and its unused slots are filled, if need be.
+  bool sane(unsigned least) const {
+    if (count < least || count > B) return false;
+    for (unsigned i = 1; i < count; ++i)
+      if (!(keys[i - 1] < keys[i])) return false;
+    for (unsigned i = count; i < B && padded; ++i)
+      if (keys[i] < unused() || unused() < keys[i]) return false;
+    return true;
+  }
+
+  friend bool operator<(const key_block &a, const key_block &b) {
+    return a.keys[a.count - 1] < b.keys[0];
+  }
+  friend bool operator>(const key_block &a, const key_block &b) {
+    return b < a;
+  }
+  friend bool operator==(const key_block &a, const key_block &b) {
+    return !(a < b) && !(b < a);
+  }
+};
+
+template <typename T, unsigned B = (64 / sizeof(T) < 4 ? 4 : 64 / sizeof(T))>
+class blocked_avltree : public Container<T>, public Iterable<T> {
+public:
+  // Constructor: empty tree.
+  blocked_avltree() : the_size(0) {}
+
+  // Returns the number of keys.
+  virtual int size() const override { return the_size; }
+
+  // Returns the number of blocks.
+  int blocks() const { return tree.size(); }
+
+  // Clears the tree, removing all blocks.
+  virtual void clear() override {
+    tree.clear();
+    the_size = 0;
+  }
+
+  // The sanity check: the blocks form a valid AVL tree, ordered by their
+  // key ranges, and each one satisfies the invariants of blocks.
+  bool sanity() const {
+    if (!tree.sanity()) return false;
+    unsigned least = tree.size() == 1 ? 1 : low;
+    bool sane = true;
+    int n = 0;
+    tree.for_each(seq, [&](const block &b) {
+      sane = sane && b.sane(least);
+      n += b.count;
+    });
+    return sane && n == the_size;
+  }
+
+  // Insert x in the tree.
+  void insert(const T &x) {
+    if (tree.root == nullptr) {
+      block b;
+      b.insert(0, x);
+      tree.insert(b);
+      ++the_size;
+      return;
+    }
+    link t = find(x);
+    if (t == nullptr) t = tree_type::leftdown(tree.root);
+    unsigned i = t->data.rank(x);
+    if (t->data.holds(i, x)) return;
+    if (t->data.count == B) {
+      link n = split(t);
+      if (i > t->data.count) {
+        i -= t->data.count;
+        t = n;
+      }
+    }
+    t->data.insert(i, x);
+    ++the_size;
+  }
+
+private:
+  // Blocks that are less full than this are merged with adjacent ones.
+  static const unsigned low = B / 4 > 0 ? B / 4 : 1;
+
+  typedef key_block<T, B> block;
+  typedef avltree<block> tree_type;
+  typedef typename tree_type::link link;
+
+  // The tree's fields.
+  tree_type tree;
+  int the_size;
+
+  // Returns the last block whose first key is not greater than x, which
+  // is the only one that may contain x, or nullptr if there is none.
+  link find(const T &x) const {
+    link c = nullptr;
+    for (link t = tree.root; t != nullptr;)
+      if (x < t->data.keys[0]) {
+        t = t->left;
+      } else {
+        c = t;
+        t = t->right;
+      }
+    return c;
+  }
+
+  // Returns the next block after t, or nullptr if t is the last one.
+  static link next(link t) {
+    if (t->right != nullptr) return tree_type::leftdown(t->right);
+    return tree_type::leftup(t);
+  }
+
+  // Returns the block before t, or nullptr if t is the first one.
+  static link prev(link t) {
+    if (t->left != nullptr) return tree_type::rightdown(t->left);
+    while (t->parent != nullptr && t->parent->right != t) t = t->parent;
+    return t->parent;
+  }
+
+  // Moves the upper half of the full block t to a new block, which is
+  // inserted right after t, and returns the new block.
+  link split(link t) {
+    block b;
+    block::shift_right(t->data, b, B / 2);
+    link p = t->right == nullptr ? t : tree_type::leftdown(t->right);
+    link n = tree_type::create(b, p);
+    tree_type::child(p, p == t ? +1 : -1) = n;
+    ++tree.the_size;
+    tree.rebalance_after_insert(n);
+    return n;
+  }
+
+  // Removes the block t from the tree.
+  void drop(link t) {
+    tree.remove(t);
+    tree_type::destroy(t);
+    --tree.the_size;
+  }
+
+  // Removes the key at position i of block t.  If the block becomes less
+  // than a quarter full, it is merged with the next block (or the previous
+  // one, if it is the last), or it takes keys from it, if both do not fit
+  // in one block.
+  void erase(link t, unsigned i) {
+    t->data.erase(i);
+    --the_size;
+    if (t->data.count >= low) return;
+    link l = t, r = next(t);
+    if (r == nullptr) {
+      r = t;
+      l = prev(t);
+    }
+    if (l == nullptr) {
+      if (t->data.count == 0) drop(t);
+      return;
+    }
+    block &a = l->data, &b = r->data;
+    unsigned half = (a.count + b.count) / 2;
+    if (a.count + b.count <= B) {
+      block::shift_left(a, b, b.count);
+      drop(r);
+    } else if (a.count > half) {
+      block::shift_right(a, b, a.count - half);
+    } else {
+      block::shift_left(a, b, half - a.count);
+    }
+  }
+
+  // Implementation of iterators for in-order traversal: a block and a
+  // position in it.
+  class BlockIteratorImpl : public Iterator<T>::Impl {
+  private:
+    typedef typename Iterator<T>::Impl Impl;
+
+  public:
+    Impl *clone() const override { return new BlockIteratorImpl(ptr, i); }
+    T &access() const override { return ptr->data.keys[i]; }
+    void advance() override {
+      if (ptr == nullptr) return;
+      if (++i == ptr->data.count) {
+        ptr = next(ptr);
+        i = 0;
+      }
+    }
+    bool equal(const Impl &j) const override {
+      return ptr == ((BlockIteratorImpl *)&j)->ptr &&
+             i == ((BlockIteratorImpl *)&j)->i;
+    }
+
+    BlockIteratorImpl(link p, unsigned i) : ptr(p), i(i) {}
+
+  protected:
+    link ptr;
+    unsigned i;
+    friend class blocked_avltree;
+  };
+
+public:
+  Iterator<T> begin() override {
+    return Iterator<T>(new BlockIteratorImpl(tree_type::leftdown(tree.root), 0));
+  }
+  Iterator<T> end() override {
+    return Iterator<T>(new BlockIteratorImpl(nullptr, 0));
+  }
+
+  // Searches the tree for key x.  If found, it returns an iterator
+  // pointing to it, otherwise it returns end().
+  Iterator<T> lookup(const T &x) {
+    link t = find(x);
+    if (t == nullptr) return end();
+    unsigned i = t->data.rank(x);
+    if (!t->data.holds(i, x)) return end();
+    return Iterator<T>(new BlockIteratorImpl(t, i));
+  }
+
+  // Removes key x from the tree, if it exists, and returns true.
+  // If it does not exist, it does nothing and returns false.
+  bool remove(const T &x) {
+    link t = find(x);
+    if (t == nullptr) return false;
+    unsigned i = t->data.rank(x);
+    if (!t->data.holds(i, x)) return false;
+    erase(t, i);
+    return true;
+  }
+
+  // Removes the element pointed to by iterator i.
+  void remove(Iterator<T> i) {
+    const BlockIteratorImpl *p =
+        dynamic_cast<const BlockIteratorImpl *>(i.getImpl());
+    erase(p->ptr, p->i);
+  }
+
+  // Calls f on every key: in order with seq, on several threads with par.
+  template <typename P, typename F>
+  void for_each(P policy, F f) const {
+    tree.for_each(policy, [&f](const block &b) {
+      for (unsigned i = 0; i < b.count; ++i) f(b.keys[i]);
+    });
+  }
+
+  // Returns init op k1 op k2 op ... op kn, where k1 < k2 < ... < kn are
+  // the keys.  With the parallel policy, op must be associative.
+  template <typename P, typename R, typename Op>
+  R reduce(P policy, R init, Op op) const {
+    return transform_reduce(policy, init, op, [](const T &x) { return x; });
+  }
+
+  // Returns init op f(k1) op f(k2) op ... op f(kn), where k1 < k2 < ... < kn
+  // are the keys.  With the parallel policy, op must be associative.
+  // Each block is reduced on its own, starting from its first key.
+  template <typename P, typename R, typename Op, typename F>
+  R transform_reduce(P policy, R init, Op op, F f) const {
+    return tree.transform_reduce(policy, init, op, [&](const block &b) {
+      R r = f(b.keys[0]);
+      for (unsigned i = 1; i < b.count; ++i) r = op(r, f(b.keys[i]));
+      return r;
+    });
+  }
+};
+
+#endif
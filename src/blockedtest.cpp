@@ -0,0 +1,98 @@
+#include <iostream>
+#include <limits>
+
+#include "blocked.hpp"
+
+using namespace std;
+
+// Simple driver program for testing blocked AVL trees.  It uses blocks of
+// only 4 keys, so that few keys are enough to split blocks on insertions
+// and to merge them or move keys between them on removals.  It starts with
+// an empty tree and reads from stdin commands of the form:
+//
+//   i key   insert key
+//   l key   prints "Y" if key was found, "N" if it was not
+//   r key   removes key, if it exists
+//   e key   removes key through the iterator that lookup returns, if it
+//           exists
+//   s       prints the tree size, i.e., number of keys
+//   n       prints the number of blocks
+//   c       clears the tree, i.e., removes all of its blocks
+//   p       prints the tree's elements, iterating through the blocks
+//   a       prints the result of the sanity check of the blocks and of
+//           the AVL tree that holds them
+//   +       prints the sum of all keys, computed in parallel
+// The output of i, l, r, s, c, p, a and + is the same as avltest's.
+// All keys are integer numbers.
+
+int main() {
+	blocked_avltree<int, 4> t;
+	char op;
+	while (cin >> op) {
+		switch (op) {
+		case 'i': {
+			int key;
+			cin >> key;
+			t.insert(key);
+			break;
+		}
+		case 'l': {
+			int key;
+			cin >> key;
+			auto i = t.lookup(key);
+			cout << (i == t.end() ? "N" : "Y") << endl;
+			break;
+		}
+		case 'r': {
+			int key;
+			cin >> key;
+			t.remove(key);
+			break;
+		}
+		case 'e': {
+			int key;
+			cin >> key;
+			auto i = t.lookup(key);
+			if (i != t.end()) t.remove(i);
+			break;
+		}
+		case 's': {
+			cout << t.size() << endl;
+			break;
+		}
+		case 'n': {
+			cout << t.blocks() << endl;
+			break;
+		}
+		case 'c': {
+			t.clear();
+			break;
+		}
+		case 'p': {
+			bool sep = false;
+			for (int x : t) {
+				cout << (sep ? " " : "") << x;
+				sep = true;
+			}
+			cout << endl;
+			break;
+		}
+		case 'a': {
+			bool sanity = t.sanity();
+			if (sanity) cout << "passed sanity check" << endl;
+			else cout << "failed sanity check" << endl;
+			break;
+		}
+		case '+': {
+			cout << t.reduce(par, 0LL, [](long long x, long long y) {
+				return x + y;
+			}) << endl;
+			break;
+		}
+		default: {
+			cerr << "Unknown operation: " << op << endl;
+			cin.ignore(numeric_limits<streamsize>::max(), '\n');
+		}
+		}
+	}
+}
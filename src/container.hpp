@@ -1,3 +1,6 @@
+#ifndef CONTAINER_HPP
+#define CONTAINER_HPP
+
 #include <typeinfo>
 
 /* Reference implementation of containers in C++, used in the course
@@ -74,3 +77,5 @@ public:
   virtual Iterator<T> begin() = 0;
   virtual Iterator<T> end() = 0;
 };
+
+#endif
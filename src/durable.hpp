@@ -0,0 +1,370 @@
+#ifndef DURABLE_HPP
+#define DURABLE_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+
+#include "avltree.hpp"
+
+/* Durability layer for AVL trees: every insert, remove and clear is
+ * appended to a write-ahead log, and the tree can be recovered after a
+ * crash by replaying the log on top of the most recent checkpoint.
+ *
+ * The log lives in file path + ".log" and the checkpoint in path + ".ckpt".
+ * Both are sequences of records of the form
+ *
+ *   [body length: 4 bytes] [FNV-1a hash of body: 4 bytes] [body]
+ *
+ * where the body is an operation code ('i', 'r' or 'c') followed by the
+ * encoded key, if any.  A checkpoint contains only 'i' records, in order.
+ * Recovery stops at the first torn or corrupt record and truncates the log
+ * there.  Replaying is idempotent, so a crash between writing a checkpoint
+ * and truncating the log loses nothing.
+ *
+ * Unless every record is synced as it is appended, a background thread
+ * writes out records that have waited too long, so that the last updates
+ * before the tree goes idle are not left in memory.
+ */
+
+// Durability levels, from the weakest to the strongest.
+enum class durability {
+  buffered, // records are written to the OS in groups, but never synced
+  group,    // each group of records is written and synced (group commit)
+            // when it is full or when its oldest record is too old
+  strict    // each record is written and synced before the update returns
+};
+
+// Log traits: how keys are encoded in log records.  The default is a raw
+// copy, which works for trivially copyable types.
+template <typename T>
+struct log_traits {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "log_traits<T> must be specialized for this type");
+
+  static void encode(std::string &buf, const T &x) {
+    buf.append(reinterpret_cast<const char *>(&x), sizeof(T));
+  }
+
+  static bool decode(const char *p, const char *end, T &x) {
+    if (end - p != sizeof(T)) return false;
+    std::memcpy(&x, p, sizeof(T));
+    return true;
+  }
+};
+
+// Strings are stored as they are; the record's length delimits them.
+template <>
+struct log_traits<std::string> {
+  static void encode(std::string &buf, const std::string &x) { buf += x; }
+
+  static bool decode(const char *p, const char *end, std::string &x) {
+    x.assign(p, end);
+    return true;
+  }
+};
+
+template <typename T>
+class durable_avltree : public Container<T>, public Iterable<T> {
+public:
+  // Opens (or creates) the durable tree stored at path and recovers its
+  // contents.  With group commit, records are synced every group_ops
+  // updates, or group_us microseconds after the oldest unsynced one,
+  // whichever comes first; the latter is done by the background thread,
+  // even if no more updates come.  Buffered records are written likewise.
+  explicit durable_avltree(const std::string &path,
+                           durability level = durability::group,
+                           int group_ops = 64, long group_us = 1000)
+      : path(path), level(level), group_ops(group_ops), group_us(group_us),
+        pending(0), failure(0), stopping(false) {
+    replay(path + ".ckpt", false);
+    replay(path + ".log", true);
+    fd = open_file(path + ".log", O_WRONLY | O_APPEND | O_CREAT);
+    // The log may have just been created; its entry must be durable too.
+    sync_dir();
+    if (level != durability::strict)
+      flusher = std::thread([this] { flush_late(); });
+  }
+
+  // Copying would share the log; it is not allowed.
+  durable_avltree(const durable_avltree &) = delete;
+  durable_avltree &operator=(const durable_avltree &) = delete;
+
+  // Destructor: stops the background thread and makes all pending records
+  // durable.
+  virtual ~durable_avltree() override {
+    if (flusher.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_one();
+      flusher.join();
+    }
+    try {
+      flush();
+    } catch (const std::system_error &) {
+    }
+    ::close(fd);
+  }
+
+  virtual int size() const override { return tree.size(); }
+
+  // Updates build their record and check that the log has not failed
+  // before they change the tree, so that an update that throws because
+  // of them leaves the tree unchanged.  If the record is then not written
+  // and synced as the level requires, the update stays in the tree, its
+  // record stays pending, and the error is thrown.
+  virtual void clear() override {
+    std::string r = prepare('c', nullptr);
+    tree.clear();
+    append(r);
+  }
+
+  bool sanity() const { return tree.sanity(); }
+
+  // Insert x in the tree.
+  void insert(const T &x) {
+    std::string r = prepare('i', &x);
+    int n = tree.size();
+    tree.insert(x);
+    if (tree.size() != n) append(r);
+  }
+
+  // Removes key x from the tree, if it exists, and returns true.
+  // If it does not exist, it does nothing and returns false.
+  bool remove(const T &x) {
+    std::string r = prepare('r', &x);
+    if (!tree.remove(x)) return false;
+    append(r);
+    return true;
+  }
+
+  Iterator<T> begin() override { return tree.begin(); }
+  Iterator<T> end() override { return tree.end(); }
+  Iterator<T> lookup(const T &x) { return tree.lookup(x); }
+
+  // Writes and syncs all pending records.  If the background thread has
+  // failed to, this throws its error.
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    commit();
+  }
+
+  // Compacts the log: writes a new checkpoint from an in-order traversal
+  // of the tree, atomically replaces the old one, and truncates the log.
+  void checkpoint() {
+    std::lock_guard<std::mutex> lock(mutex);
+    commit();
+    std::string tmp = path + ".ckpt.tmp", data;
+    for (const T &x : tree) record(data, 'i', &x);
+    int ck = open_file(tmp, O_WRONLY | O_CREAT | O_TRUNC);
+    write_all(ck, data);
+    sync(ck);
+    ::close(ck);
+    if (::rename(tmp.c_str(), (path + ".ckpt").c_str()) != 0)
+      throw std::system_error(errno, std::generic_category(), tmp);
+    // The log must not be truncated before the rename is durable.
+    sync_dir();
+    if (::ftruncate(fd, 0) != 0)
+      throw std::system_error(errno, std::generic_category(), path);
+    sync(fd);
+  }
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  avltree<T> tree;
+  std::string path;
+  durability level;
+  int group_ops;
+  long group_us;
+  int fd;
+  std::string buf;      // records not yet written
+  int pending;          // records not yet synced
+  clock::time_point oldest; // when the oldest of them was appended
+  int failure;          // errno of a failed background commit, or 0
+
+  // The background thread.  The mutex guards the log and the fields from
+  // buf to failure, which the thread shares with updates.
+  std::thread flusher;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+
+  // Returns the record of an update with operation op and key x, if the
+  // background thread has not failed; otherwise, it throws its error.
+  std::string prepare(char op, const T *x) {
+    std::string r;
+    record(r, op, x);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (failure != 0)
+      throw std::system_error(failure, std::generic_category(), path);
+    return r;
+  }
+
+  // Appends a record to the log and commits the group, if it is complete.
+  void append(const std::string &r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buf += r;
+    if (pending++ == 0) {
+      oldest = clock::now();
+      wake.notify_one();
+    }
+    if (level == durability::strict || pending >= group_ops) commit();
+  }
+
+  // Writes and syncs all pending records; the mutex must be held.
+  void commit() {
+    if (failure != 0)
+      throw std::system_error(failure, std::generic_category(), path);
+    write_all(fd, buf);
+    if (pending > 0 && level != durability::buffered) sync(fd);
+    pending = 0;
+  }
+
+  // The body of the background thread: commits the pending records when
+  // the oldest one has waited for group_us microseconds, until stopped.
+  // An error is kept, to be thrown by the next update or flush.
+  void flush_late() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      if (pending == 0 || failure != 0) {
+        wake.wait(lock);
+        continue;
+      }
+      clock::time_point due = oldest + std::chrono::microseconds(group_us);
+      if (clock::now() < due) {
+        wake.wait_until(lock, due);
+        continue;
+      }
+      try {
+        commit();
+      } catch (const std::system_error &e) {
+        failure = e.code().value();
+      }
+    }
+  }
+
+  // Encodes a record with operation op and key x (if not nullptr) at the
+  // end of buffer b.
+  static void record(std::string &b, char op, const T *x) {
+    std::string body(1, op);
+    if (x != nullptr) log_traits<T>::encode(body, *x);
+    uint32_t header[2] = {static_cast<uint32_t>(body.size()), hash(body)};
+    b.append(reinterpret_cast<const char *>(header), sizeof header);
+    b += body;
+  }
+
+  // The 32-bit FNV-1a hash of s.
+  static uint32_t hash(const std::string &s) {
+    uint32_t h = 2166136261u;
+    for (unsigned char c : s) h = (h ^ c) * 16777619u;
+    return h;
+  }
+
+  // Replays the records in the file named name, if it exists, on the tree.
+  // If truncate is true, a torn or corrupt tail is cut off the file.
+  void replay(const std::string &name, bool truncate) {
+    int f = ::open(name.c_str(), O_RDONLY);
+    if (f < 0) {
+      if (errno == ENOENT) return;
+      throw std::system_error(errno, std::generic_category(), name);
+    }
+    std::string data;
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = ::read(f, chunk, sizeof chunk)) > 0) data.append(chunk, n);
+    ::close(f);
+    if (n < 0) throw std::system_error(errno, std::generic_category(), name);
+
+    const char *p = data.data(), *end = p + data.size();
+    while (true) {
+      uint32_t header[2];
+      if (end - p < (ssize_t)sizeof header) break;
+      std::memcpy(header, p, sizeof header);
+      const char *body = p + sizeof header;
+      if (header[0] == 0 || end - body < header[0]) break;
+      std::string s(body, header[0]);
+      if (hash(s) != header[1] || !apply(s)) break;
+      p = body + header[0];
+    }
+    if (truncate && p != end && ::truncate(name.c_str(), p - data.data()) != 0)
+      throw std::system_error(errno, std::generic_category(), name);
+  }
+
+  // Applies the body of a record to the tree.  Returns false if it is
+  // not a valid record.
+  bool apply(const std::string &body) {
+    const char *p = body.data() + 1, *end = body.data() + body.size();
+    if (body[0] == 'c') {
+      tree.clear();
+      return p == end;
+    }
+    T x;
+    if (!log_traits<T>::decode(p, end, x)) return false;
+    if (body[0] == 'i')
+      tree.insert(x);
+    else if (body[0] == 'r')
+      tree.remove(x);
+    else
+      return false;
+    return true;
+  }
+
+  static int open_file(const std::string &name, int flags) {
+    int f = ::open(name.c_str(), flags, 0644);
+    if (f < 0) throw std::system_error(errno, std::generic_category(), name);
+    return f;
+  }
+
+  // Writes data to file f and erases it.  If that fails, only what was
+  // written is erased, so that a retry appends the rest of a torn record
+  // rather than writing it again.
+  static void write_all(int f, std::string &data) {
+    const char *p = data.data(), *end = p + data.size();
+    while (p != end) {
+      ssize_t n = ::write(f, p, end - p);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        int e = errno;
+        data.erase(0, p - data.data());
+        throw std::system_error(e, std::generic_category());
+      }
+      p += n;
+    }
+    data.clear();
+  }
+
+  static void sync(int f) {
+    if (::fdatasync(f) != 0)
+      throw std::system_error(errno, std::generic_category());
+  }
+
+  // Syncs the directory that holds the log and the checkpoint, so that
+  // files created or renamed in it survive a crash.
+  void sync_dir() const {
+    std::string::size_type i = path.rfind('/');
+    std::string dir = i == std::string::npos ? "." : path.substr(0, i + 1);
+    int d = open_file(dir, O_RDONLY | O_DIRECTORY);
+    if (::fsync(d) != 0) {
+      int e = errno;
+      ::close(d);
+      throw std::system_error(e, std::generic_category(), dir);
+    }
+    ::close(d);
+  }
+};
+
+#endif
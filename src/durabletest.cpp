@@ -0,0 +1,117 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "durable.hpp"
+
+using namespace std;
+
+// Simple driver program for testing crash recovery of durable trees.
+// Run it as "durabletest path [buffered|group|strict]": it opens the tree
+// stored at path, recovering it if it exists, and reads from stdin
+// commands of the form:
+//
+//   i key   insert key
+//   l key   prints "Y" if key was found, "N" if it was not
+//   r key   removes key, if it exists
+//   s       prints the tree size, i.e., number of nodes
+//   c       clears the tree, i.e., removes all of its nodes
+//   p       prints the tree's elements using in-order traversal
+//   a       prints the result of the AVL sanity check
+//   f       makes all pending records durable
+//   k       writes a checkpoint and truncates the log
+//   o       closes the tree and opens it again, recovering it
+//   q       crashes, i.e., exits at once, losing pending records
+//   t n     crashes, leaving n bytes of a torn record at the end of the log
+// Running the program again on the same path recovers what was durable.
+// All keys are integer numbers.
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " path [buffered|group|strict]" << endl;
+		return 2;
+	}
+	string path = argv[1], mode = argc > 2 ? argv[2] : "group";
+	durability level = mode == "strict" ? durability::strict :
+		mode == "buffered" ? durability::buffered : durability::group;
+	unique_ptr<durable_avltree<int>> t(new durable_avltree<int>(path, level));
+	char op;
+	while (cin >> op) {
+		switch (op) {
+		case 'i': {
+			int key;
+			cin >> key;
+			t->insert(key);
+			break;
+		}
+		case 'l': {
+			int key;
+			cin >> key;
+			auto i = t->lookup(key);
+			cout << (i == t->end() ? "N" : "Y") << endl;
+			break;
+		}
+		case 'r': {
+			int key;
+			cin >> key;
+			t->remove(key);
+			break;
+		}
+		case 's': {
+			cout << t->size() << endl;
+			break;
+		}
+		case 'c': {
+			t->clear();
+			break;
+		}
+		case 'p': {
+			bool sep = false;
+			for (int x : *t) {
+				cout << (sep ? " " : "") << x;
+				sep = true;
+			}
+			cout << endl;
+			break;
+		}
+		case 'a': {
+			bool sanity = t->sanity();
+			if (sanity) cout << "passed sanity check" << endl;
+			else cout << "failed sanity check" << endl;
+			break;
+		}
+		case 'f': {
+			t->flush();
+			break;
+		}
+		case 'k': {
+			t->checkpoint();
+			break;
+		}
+		case 'o': {
+			t.reset();
+			t.reset(new durable_avltree<int>(path, level));
+			break;
+		}
+		case 'q': {
+			_exit(0);
+		}
+		case 't': {
+			int n;
+			cin >> n;
+			string torn(n, 'x');
+			int f = open((path + ".log").c_str(), O_WRONLY | O_APPEND);
+			if (f < 0 || write(f, torn.data(), n) != n) _exit(1);
+			_exit(0);
+		}
+		default: {
+			cerr << "Unknown operation: " << op << endl;
+			cin.ignore(numeric_limits<streamsize>::max(), '\n');
+		}
+		}
+	}
+}
@@ -0,0 +1,264 @@
+#ifndef PAGED_HPP
+#define PAGED_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "avltree.hpp"
+
+/* Disk-backed storage for AVL trees, for key sets larger than memory:
+ *
+ *   paged_storage<>::open("/var/tmp/keys.pages", 1 << 18);
+ *   avltree<int, paged_storage<>> t;
+ *
+ * Nodes live in fixed-size pages of a memory-mapped file and are linked by
+ * (page, slot) offsets instead of addresses.  A new node is placed in its
+ * parent's page if there is room, otherwise in the page currently being
+ * filled, so that a lookup touches as few pages as possible.  The pages
+ * touched are kept in LRU order, and when more than the given number of
+ * them are resident, the least recently used one is dropped from memory.
+ * The kernel writes it back to the file and reads it in again when it is
+ * next touched, so references to nodes never dangle.
+ *
+ * The file is scratch space: it is truncated when opened and removed when
+ * closed, and all trees using it must be destroyed before that.  Each Tag
+ * type selects a separate file, so that several can be open at once.
+ * Nodes must not own memory, e.g., avltree<std::string> cannot be paged.
+ * Paged trees are not thread-safe, and apply_batch() runs sequentially.
+ */
+
+template <typename Tag>
+class paged_storage;
+
+// A pointer to a node of type N stored in the file of paged_storage<Tag>.
+// Page 0 holds no nodes, so (0, 0) is the null pointer.
+template <typename N, typename Tag>
+class paged_ptr {
+public:
+  paged_ptr(std::nullptr_t = nullptr) : page(0), slot(0) {}
+
+  N *operator->() const { return get(); }
+  N &operator*() const { return *get(); }
+  explicit operator bool() const { return page != 0; }
+
+  bool operator==(const paged_ptr &p) const {
+    return page == p.page && slot == p.slot;
+  }
+  bool operator!=(const paged_ptr &p) const { return !(*this == p); }
+
+  // Returns the address of the node, marking its page as recently used.
+  N *get() const {
+    return reinterpret_cast<N *>(paged_storage<Tag>::touch(page) +
+                                 paged_storage<Tag>::header_size +
+                                 slot * sizeof(N));
+  }
+
+private:
+  uint32_t page, slot;
+
+  paged_ptr(uint32_t page, uint32_t slot) : page(page), slot(slot) {}
+  friend class paged_storage<Tag>;
+};
+
+template <typename Tag = void>
+class paged_storage {
+public:
+  static const size_t page_size = 4096;
+
+  template <typename N>
+  using pointer = paged_ptr<N, Tag>;
+
+  static const bool concurrent = false;
+
+  // Creates the file at path.  At most resident_pages pages are kept in
+  // memory and the file can grow up to max_pages pages.
+  static void open(const std::string &path, size_t resident_pages,
+                   size_t max_pages = size_t(1) << 28) {
+    state &s = self();
+    if (s.base != nullptr) throw std::logic_error("paged storage is open");
+    s.fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (s.fd < 0) throw std::system_error(errno, std::generic_category(), path);
+    void *m = ::mmap(nullptr, max_pages * page_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m == MAP_FAILED) {
+      ::close(s.fd);
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    s.path = path;
+    s.base = static_cast<char *>(m);
+    s.max_pages = max_pages;
+    s.capacity = resident_pages > 0 ? resident_pages : 1;
+    new_page(); // page 0, which is never used
+  }
+
+  // Unmaps and removes the file.
+  static void close() {
+    state &s = self();
+    if (s.base == nullptr) return;
+    ::munmap(s.base, s.max_pages * page_size);
+    ::close(s.fd);
+    ::unlink(s.path.c_str());
+    s = state();
+  }
+
+  // Returns the number of pages in the file.
+  static size_t pages() { return self().npages; }
+
+  // Returns the number of pages currently kept in memory.
+  static size_t resident() { return self().nresident; }
+
+  template <typename N, typename... Args>
+  static pointer<N> create(pointer<N> near, const Args &...args) {
+    static_assert(std::is_trivially_destructible<N>::value,
+                  "nodes in paged storage must not own memory");
+    state &s = self();
+    if (s.slot_size == 0) {
+      s.slot_size = sizeof(N);
+      s.slots = (page_size - header_size) / sizeof(N);
+      if (s.slots > max_slots) s.slots = max_slots;
+    } else if (s.slot_size != sizeof(N))
+      throw std::logic_error("paged storage holds nodes of another type");
+
+    uint32_t page = near.page;
+    if (page == 0 || full(page)) page = s.fill;
+    while (page == 0 || full(page)) {
+      if (s.spare.empty()) {
+        page = new_page();
+      } else {
+        page = s.spare.back();
+        s.spare.pop_back();
+      }
+    }
+    s.fill = page;
+
+    header *h = reinterpret_cast<header *>(touch(page));
+    uint32_t slot = 0;
+    for (int w = 0;; ++w, slot += 64)
+      if (~h->used[w] != 0) {
+        slot += __builtin_ctzll(~h->used[w]);
+        h->used[w] |= uint64_t(1) << (slot % 64);
+        break;
+      }
+    ++h->count;
+    pointer<N> p(page, slot);
+    new (p.get()) N(args...);
+    return p;
+  }
+
+  template <typename N>
+  static void destroy(pointer<N> p) {
+    p->~N();
+    header *h = reinterpret_cast<header *>(touch(p.page));
+    if (h->count-- == self().slots) self().spare.push_back(p.page);
+    h->used[p.slot / 64] &= ~(uint64_t(1) << (p.slot % 64));
+  }
+
+private:
+  // Each page starts with a header recording which slots are used.
+  static const size_t max_slots = 448;
+  struct header {
+    uint64_t used[max_slots / 64];
+    uint32_t count;
+  };
+  static const size_t header_size = 64;
+  static_assert(sizeof(header) <= header_size, "page header too large");
+
+  // Pages are mapped in chunks of this many.
+  static const size_t chunk = 1024;
+
+  struct state {
+    std::string path;
+    int fd = -1;
+    char *base = nullptr;
+    size_t max_pages = 0, mapped = 0, npages = 0;
+    size_t slot_size = 0, slots = 0;
+    uint32_t fill = 0;           // the page currently being filled
+    std::vector<uint32_t> spare; // other pages with free slots
+    // Resident pages in LRU order, from head (most recently used) to tail.
+    size_t capacity = 0, nresident = 0;
+    uint32_t head = 0, tail = 0;
+    std::vector<uint32_t> prev, next;
+    std::vector<char> in_memory;
+  };
+
+  static state &self() {
+    static state s;
+    return s;
+  }
+
+  static bool full(uint32_t page) {
+    return reinterpret_cast<header *>(touch(page))->count == self().slots;
+  }
+
+  // Appends a zeroed page to the file and returns its number.
+  static uint32_t new_page() {
+    state &s = self();
+    if (s.npages == s.mapped) {
+      if (s.mapped + chunk > s.max_pages) throw std::bad_alloc();
+      off_t off = s.mapped * page_size, len = chunk * page_size;
+      if (::ftruncate(s.fd, off + len) != 0 ||
+          ::mmap(s.base + off, len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, s.fd, off) == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), s.path);
+      s.mapped += chunk;
+    }
+    s.prev.push_back(0);
+    s.next.push_back(0);
+    s.in_memory.push_back(false);
+    return s.npages++;
+  }
+
+  // Returns the address of a page and moves it to the head of the LRU
+  // list, dropping the tail from memory if too many pages are resident.
+  static char *touch(uint32_t page) {
+    state &s = self();
+    char *p = s.base + page * page_size;
+    if (page == s.head && s.in_memory[page]) return p;
+    if (s.in_memory[page]) {
+      detach(page);
+    } else {
+      s.in_memory[page] = true;
+      ++s.nresident;
+    }
+    s.next[page] = s.head;
+    if (s.nresident > 1) s.prev[s.head] = page; else s.tail = page;
+    s.head = page;
+    if (s.nresident > s.capacity) {
+      uint32_t victim = s.tail;
+      detach(victim);
+      s.in_memory[victim] = false;
+      --s.nresident;
+      ::madvise(s.base + victim * page_size, page_size, MADV_DONTNEED);
+    }
+    return p;
+  }
+
+  // Removes a resident page from the LRU list.
+  static void detach(uint32_t page) {
+    state &s = self();
+    if (page == s.head)
+      s.head = s.next[page];
+    else
+      s.next[s.prev[page]] = s.next[page];
+    if (page == s.tail)
+      s.tail = s.prev[page];
+    else
+      s.prev[s.next[page]] = s.prev[page];
+  }
+
+  template <typename N, typename T>
+  friend class paged_ptr;
+};
+
+#endif
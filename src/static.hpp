@@ -0,0 +1,195 @@
+#ifndef STATIC_HPP
+#define STATIC_HPP
+
+#include <cstddef>
+#include <initializer_list>
+#include <stdexcept>
+
+/* Static AVL trees, for fixed sets of keys known at compile time:
+ *
+ *   constexpr static_avltree<int, 5> codes = {200, 404, 301, 500, 418};
+ *   static_assert(codes.sanity(), "bad table");
+ *   static_assert(codes.contains(404), "");
+ *
+ * The tree is built by the constexpr constructor, so a constexpr (or
+ * static) tree is laid out by the compiler: it is a flat array of N nodes
+ * in read-only data, with no heap and no work at startup.  The tree is
+ * complete, i.e., all its levels are full except possibly the last, which
+ * is filled from the left; this is a valid AVL tree of the least possible
+ * height.  Its nodes are stored in breadth-first order, so that the top
+ * levels, which every lookup visits, share cache lines.  Each node records
+ * its links and balance factor, which sanity() checks like avltree's.
+ *
+ * Keys must be a literal type with a constexpr operator<.  The tree is
+ * immutable: there is no insert or remove, and lookups and iteration can
+ * run both at compile time and at run time.
+ */
+
+template <typename T, size_t N>
+class static_avltree {
+public:
+  // Constructor: a tree with the given keys, which must be exactly N and
+  // distinct.  In a constant expression, violations fail to compile.
+  constexpr static_avltree(std::initializer_list<T> keys)
+      : nodes(), root(N > 0 ? 0 : -1) {
+    if (keys.size() != N)
+      throw std::length_error("static_avltree: wrong number of keys");
+    T sorted[N > 0 ? N : 1] = {};
+    size_t n = 0;
+    for (const T &x : keys) {
+      size_t j = n++;
+      for (; j > 0 && x < sorted[j - 1]; --j) sorted[j] = sorted[j - 1];
+      sorted[j] = x;
+    }
+    for (size_t i = 1; i < N; ++i)
+      if (!(sorted[i - 1] < sorted[i]))
+        throw std::invalid_argument("static_avltree: duplicate keys");
+    place(sorted, 0, 0);
+  }
+
+  // Returns the number of nodes.
+  constexpr int size() const { return N; }
+  constexpr bool empty() const { return N == 0; }
+
+  // The sanity check: every node's children point back to it, the keys
+  // are in order, every balance factor is the difference of the heights
+  // of the node's subtrees and is -1, 0 or +1, and there are N nodes.
+  constexpr bool sanity() const {
+    int n = 0;
+    if (root >= 0 && nodes[root].parent >= 0) return false;
+    if (insanity(root, n) < 0 || n != (int)N) return false;
+    const T *last = nullptr;
+    for (const T &x : *this) {
+      if (last != nullptr && !(*last < x)) return false;
+      last = &x;
+    }
+    return true;
+  }
+
+private:
+  // The tree's node.  Links are positions in the array, and -1 is null.
+  struct node {
+    T data;
+    signed char balance;
+    int left, right, parent;
+  };
+
+  // The tree's fields.
+  node nodes[N > 0 ? N : 1];
+  int root;
+
+  // Returns the height of the subtree rooted at position i of a complete
+  // tree with N nodes.
+  static constexpr int height(size_t i) {
+    int h = 0;
+    for (; i < N; i = 2 * i + 1) ++h;
+    return h;
+  }
+
+  // Places the sorted keys, from position k on, in order in the subtree
+  // rooted at position i, and returns the position of the next key.
+  constexpr size_t place(const T *sorted, size_t i, size_t k) {
+    if (i >= N) return k;
+    node &t = nodes[i];
+    t.left = 2 * i + 1 < N ? int(2 * i + 1) : -1;
+    t.right = 2 * i + 2 < N ? int(2 * i + 2) : -1;
+    t.parent = i > 0 ? int(i - 1) / 2 : -1;
+    t.balance = height(2 * i + 2) - height(2 * i + 1);
+    k = place(sorted, 2 * i + 1, k);
+    t.data = sorted[k++];
+    return place(sorted, 2 * i + 2, k);
+  }
+
+  // Returns the height of the subtree rooted at position i, and counts
+  // its nodes in n, or returns -1 if it is not a valid AVL subtree.
+  constexpr int insanity(int i, int &n) const {
+    if (i < 0) return 0;
+    if (i >= (int)N || ++n > (int)N) return -1;
+    const node &t = nodes[i];
+    if (t.left >= 0 && (t.left >= (int)N || nodes[t.left].parent != i))
+      return -1;
+    if (t.right >= 0 && (t.right >= (int)N || nodes[t.right].parent != i))
+      return -1;
+    int l = insanity(t.left, n), r = insanity(t.right, n);
+    if (l < 0 || r < 0 || r - l != t.balance || r - l > 1 || l - r > 1)
+      return -1;
+    return 1 + (l > r ? l : r);
+  }
+
+  // Returns the position of the leftmost node of the subtree rooted at i.
+  constexpr int leftdown(int i) const {
+    if (i < 0) return -1;
+    while (nodes[i].left >= 0) i = nodes[i].left;
+    return i;
+  }
+
+public:
+  // Iterators for in-order traversal.
+  class const_iterator {
+  public:
+    constexpr const T &operator*() const { return tree->nodes[i].data; }
+    constexpr const T *operator->() const { return &tree->nodes[i].data; }
+
+    constexpr const_iterator &operator++() {
+      if (i < 0) return *this;
+      if (tree->nodes[i].right >= 0) {
+        i = tree->leftdown(tree->nodes[i].right);
+        return *this;
+      }
+      int p = tree->nodes[i].parent;
+      while (p >= 0 && tree->nodes[p].left != i) {
+        i = p;
+        p = tree->nodes[p].parent;
+      }
+      i = p;
+      return *this;
+    }
+    constexpr const_iterator operator++(int) {
+      const_iterator result(*this);
+      ++*this;
+      return result;
+    }
+
+    constexpr bool operator==(const const_iterator &j) const {
+      return i == j.i;
+    }
+    constexpr bool operator!=(const const_iterator &j) const {
+      return i != j.i;
+    }
+
+  private:
+    const static_avltree *tree;
+    int i;
+
+    constexpr const_iterator(const static_avltree *tree, int i)
+        : tree(tree), i(i) {}
+    friend class static_avltree;
+  };
+
+  constexpr const_iterator begin() const {
+    return const_iterator(this, leftdown(root));
+  }
+  constexpr const_iterator end() const { return const_iterator(this, -1); }
+
+  // Searches the tree for key x.  If found, it returns an iterator
+  // pointing to it, otherwise it returns end().  The search takes at most
+  // as many steps as the tree's height, a constant, so that the compiler
+  // can unroll it for small trees.
+  constexpr const_iterator lookup(const T &x) const {
+    int i = root;
+    for (int d = 0; d < height(0) && i >= 0; ++d) {
+      if (x < nodes[i].data)
+        i = nodes[i].left;
+      else if (nodes[i].data < x)
+        i = nodes[i].right;
+      else
+        return const_iterator(this, i);
+    }
+    return end();
+  }
+
+  // Returns true if key x is in the tree.
+  constexpr bool contains(const T &x) const { return lookup(x) != end(); }
+};
+
+#endif